@@ -0,0 +1,30 @@
+#!/bin/bash
+# Script builtin benchmark.
+# Runs a script of BENCH_SCRIPT_LINES identical lines with the shell's own echo,
+# test and true, then with the same programs exec'd by full path, and prints CSV
+# rows of the mean microseconds per line.
+# Usage: bench/builtins.sh [sshell binary]
+set -e
+SSHELL=${1:-./sshell}
+LINES=${BENCH_SCRIPT_LINES:-$([ -n "$BENCH_QUICK" ] && echo 2000 || echo 100000)}
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+run() {
+	local name=$1 line=$2
+	for ((i = 0; i < LINES; i++)); do echo "$line"; done > "$WORK/script"
+	start=$EPOCHREALTIME
+	"$SSHELL" -q "$WORK/script" > /dev/null
+	end=$EPOCHREALTIME
+	awk -v s="$start" -v e="$end" -v n="$LINES" -v name="$name" \
+		'BEGIN { printf "script_%s,%d,%.2f,us\n", name, n, (e - s) / n * 1e6 }'
+}
+
+echo "benchmark,parameter,value,unit"
+run echo_builtin "echo hello world"
+[ -x /bin/echo ] && run echo_exec "/bin/echo hello world"
+run test_builtin "test -f /etc/passwd"
+[ -x /usr/bin/test ] && run test_exec "/usr/bin/test -f /etc/passwd"
+run true_builtin "true"
+[ -x /bin/true ] && run true_exec "/bin/true"
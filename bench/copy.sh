@@ -0,0 +1,29 @@
+#!/bin/bash
+# File copy benchmark for "cat file > out" and "cat a b > out".
+# Compares the shell's in-process copy (copy_file_range/sendfile/reflink) against
+# exec'ing /bin/cat (SSHELL_RELAY=0) and prints CSV rows of MB/s.
+# Usage: bench/copy.sh [sshell binary]
+# BENCH_COPY_MB sets the source file size, BENCH_COPY_DIR where files are written.
+set -e
+SSHELL=${1:-./sshell}
+MB=${BENCH_COPY_MB:-2048}
+
+WORK=$(mktemp -d "${BENCH_COPY_DIR:-${TMPDIR:-/tmp}}/sshell-copy.XXXXXX")
+trap 'rm -rf "$WORK"' EXIT
+head -c $((MB * 1024 * 1024)) /dev/urandom > "$WORK/a"
+cp "$WORK/a" "$WORK/b"
+
+echo "benchmark,parameter,value,unit"
+for files in 1 2; do
+	line="cat $WORK/a > $WORK/out"
+	[ $files = 2 ] && line="cat $WORK/a $WORK/b > $WORK/out"
+	for relay in 1 0; do
+		name=$([ $relay = 1 ] && echo inprocess || echo exec)
+		rm -f "$WORK/out"
+		start=$EPOCHREALTIME
+		SSHELL_RELAY=$relay "$SSHELL" -q -c "$line"
+		end=$EPOCHREALTIME
+		awk -v s="$start" -v e="$end" -v n="$files" -v mb="$((MB * files))" -v name="$name" \
+			'BEGIN { printf "copy_throughput_%s,%d,%.1f,MB/s\n", name, n, mb / (e - s) }'
+	done
+done
@@ -0,0 +1,98 @@
+// Parser micro-benchmark.
+// Feeds synthetic command lines of 1 KB to 1 MB through ParseCmd with every token
+// scanner the CPU supports and prints throughput as CSV. A flat MB/s column across
+// sizes means parsing is linear.
+// Build with "make bench/parse_bench".
+
+// Pull in the shell itself, minus its main loop.
+#define main sshell_main
+#include "../sshell.c"
+#undef main
+
+// Fills line with len bytes of words, paths and pipes, like a long generated command line.
+void BuildLine(char *line, int len)
+{
+	int i = 0;
+	int word = 0;
+	while (i < len)
+	{
+		int n;
+		if (word > 0 && word % 16 == 0)
+			n = snprintf(line + i, len - i + 1, "| ");
+		else if (word % 4 == 0)
+			n = snprintf(line + i, len - i + 1, "/var/log/generated/batch/output-%08d.log ", word);
+		else
+			n = snprintf(line + i, len - i + 1, "arg%d  ", word);
+		i += n;
+		word++;
+	}
+	line[len] = '\0';
+	// Never end on a dangling pipe.
+	for (int j = len - 1; j >= 0 && (line[j] == ' ' || line[j] == '|'); j--) line[j] = 'x';
+}
+
+double Clock(void)
+{
+	struct timespec now = Now();
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+struct Scanner
+{
+	const char *name;
+	int (*scan)(const char *line, int i, int line_len);
+	int supported;
+};
+
+// Parses lines of every size with the current ScanToken.
+void RunSizes(const char *scanner_name)
+{
+	struct CommandSet allCmd;
+	allCmd.arena = (struct Arena) { NULL, NULL, NULL };
+
+	for (int len = 1024; len <= 1024 * 1024; len *= 4)
+	{
+		char *line = malloc(len + 1);
+		BuildLine(line, len);
+
+		// Parse roughly 256 MB of input per size, 32 MB with BENCH_QUICK.
+		int iterations = (getenv("BENCH_QUICK") ? 32 : 256) * 1024 * 1024 / len;
+		double start = Clock();
+		for (int i = 0; i < iterations; i++)
+		{
+			ArenaReset(&allCmd.arena);
+			if (ParseCmd(&allCmd, line, len))
+			{
+				fprintf(stderr, "parse_bench: line of %d bytes failed to parse\n", len);
+				exit(1);
+			}
+		}
+		double elapsed = Clock() - start;
+
+		printf("parse_throughput_%s,%d,%.1f,MB/s\n", scanner_name, len,
+			(double) len * iterations / elapsed / 1e6);
+		printf("parse_latency_%s,%d,%.2f,us\n", scanner_name, len, elapsed / iterations * 1e6);
+		free(line);
+	}
+}
+
+int main(void)
+{
+	__builtin_cpu_init();
+	struct Scanner scanners[] = {
+		{ "scalar", ScanTokenScalar, 1 },
+#if defined(__x86_64__)
+		{ "sse2", ScanTokenSSE2, __builtin_cpu_supports("sse2") },
+		{ "avx2", ScanTokenAVX2, __builtin_cpu_supports("avx2") },
+#endif
+	};
+
+	printf("benchmark,parameter,value,unit\n");
+	for (size_t i = 0; i < sizeof(scanners) / sizeof(scanners[0]); i++)
+	{
+		if (!scanners[i].supported) continue;
+		ScanToken = scanners[i].scan;
+		RunSizes(scanners[i].name);
+	}
+	return 0;
+}
@@ -0,0 +1,33 @@
+#!/bin/bash
+# Pipeline throughput benchmark.
+# Pushes a file through "cat file | cat | ... | cat > /dev/null" for a growing
+# number of "| cat" stages and prints CSV rows of MB/s against that count, once
+# with cat stages run as splice relays and once with /bin/cat exec'd. The
+# smallest line is "cat file | cat": a lone "cat file > out" is copied by the
+# shell itself and measured by copy.sh instead.
+# Usage: bench/pipeline.sh [sshell binary]
+# BENCH_PIPE_MB sets the data size, BENCH_PIPE_STAGES the stage counts to run.
+set -e
+SSHELL=${1:-./sshell}
+MB=${BENCH_PIPE_MB:-64}
+STAGES=${BENCH_PIPE_STAGES:-"1 2 4 8 16 32 64 128 256"}
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+head -c $((MB * 1024 * 1024)) /dev/urandom > "$WORK/data"
+
+echo "benchmark,parameter,value,unit"
+for stages in $STAGES; do
+	line="cat $WORK/data"
+	for ((i = 0; i < stages; i++)); do line+=" | cat"; done
+	line+=" > /dev/null"
+
+	for relay in 1 0; do
+		name=$([ $relay = 1 ] && echo relay || echo exec)
+		start=$EPOCHREALTIME
+		SSHELL_RELAY=$relay "$SSHELL" -q -c "$line"
+		end=$EPOCHREALTIME
+		awk -v s="$start" -v e="$end" -v n="$stages" -v mb="$MB" -v name="$name" \
+			'BEGIN { printf "pipeline_throughput_%s,%d,%.1f,MB/s\n", name, n, mb / (e - s) }'
+	done
+done
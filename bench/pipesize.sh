@@ -0,0 +1,23 @@
+#!/bin/bash
+# Pipe capacity benchmark.
+# Pushes a file through a 4-stage cat pipeline with the default 64 KB pipes,
+# 1 MB pipes and the system maximum, and prints CSV rows of MB/s per size.
+# Usage: bench/pipesize.sh [sshell binary]
+# BENCH_PIPE_MB sets the data size.
+set -e
+SSHELL=${1:-./sshell}
+MB=${BENCH_PIPE_MB:-256}
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+head -c $((MB * 1024 * 1024)) /dev/urandom > "$WORK/data"
+line="cat $WORK/data | cat | cat | cat > /dev/null"
+
+echo "benchmark,parameter,value,unit"
+for size in 64k 1m max; do
+	start=$EPOCHREALTIME
+	SSHELL_PIPESIZE=$size "$SSHELL" -q -c "$line"
+	end=$EPOCHREALTIME
+	awk -v s="$start" -v e="$end" -v size="$size" -v mb="$MB" \
+		'BEGIN { printf "pipesize_throughput,%s,%.1f,MB/s\n", size, mb / (e - s) }'
+done
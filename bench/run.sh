@@ -0,0 +1,23 @@
+#!/bin/bash
+# Runs every benchmark against one sshell binary and prints a single CSV table,
+# so runs can be saved and diffed to catch regressions. Used by "make bench".
+# Usage: bench/run.sh [sshell binary]
+# BENCH_QUICK=1 shrinks every benchmark to a few seconds, BENCH_ONLY picks a
+# subset by name (e.g. "parse spawn").
+set -e -o pipefail
+SSHELL=${1:-./sshell}
+BENCH=$(dirname "$0")
+ONLY=${BENCH_ONLY:-"parse spawn builtins pipeline pipesize copy sls"}
+if [ -n "$BENCH_QUICK" ]; then
+	export BENCH_PIPE_MB=${BENCH_PIPE_MB:-16}
+	export BENCH_PIPE_STAGES=${BENCH_PIPE_STAGES:-"1 4 16"}
+	export BENCH_COPY_MB=${BENCH_COPY_MB:-64}
+fi
+
+echo "benchmark,parameter,value,unit"
+for name in $ONLY; do
+	case $name in
+		parse) "$BENCH/parse_bench" ;;
+		*) "$BENCH/$name.sh" "$SSHELL" ;;
+	esac | tail -n +2
+done
@@ -0,0 +1,50 @@
+#!/bin/bash
+# sls builtin latency benchmark.
+# Fills directories with 10 to 1M empty files, runs sls in each enough times to
+# read about a million entries, and prints CSV rows of the mean milliseconds per
+# listing, once per SSHELL_SLS_THREADS setting and once sorted by size then name
+# ("sls -N -S"). The shell's own startup is measured with pwd and subtracted.
+# Usage: bench/sls.sh [sshell binary]
+# BENCH_SLS_SIZES sets the entry counts, BENCH_SLS_THREADS the thread counts and
+# BENCH_SLS_DIR where directories are made.
+set -e
+SSHELL=$(realpath "${1:-./sshell}")
+SIZES=${BENCH_SLS_SIZES:-$([ -n "$BENCH_QUICK" ] && echo "10 1000 10000" || echo "10 1000 100000 1000000")}
+THREADS=${BENCH_SLS_THREADS:-"1 8"}
+
+WORK=$(mktemp -d "${BENCH_SLS_DIR:-${TMPDIR:-/tmp}}/sshell-sls.XXXXXX")
+trap 'rm -rf "$WORK"' EXIT
+
+echo "benchmark,parameter,value,unit"
+for entries in $SIZES; do
+	dir="$WORK/$entries"
+	mkdir "$dir"
+	(cd "$dir" && seq -f "file%.0f" 1 "$entries" | xargs touch)
+
+	runs=$((1000000 / entries))
+	[ $runs -gt 1000 ] && runs=1000
+	[ $runs -lt 1 ] && runs=1
+	for ((i = 0; i < runs; i++)); do echo sls; done > "$WORK/script"
+	for ((i = 0; i < runs; i++)); do echo sls -N -S; done > "$WORK/sorted"
+	for ((i = 0; i < runs; i++)); do echo pwd; done > "$WORK/baseline"
+
+	cd "$dir"
+	for threads in $THREADS; do
+		start=$EPOCHREALTIME
+		"$SSHELL" -q "$WORK/baseline" > /dev/null
+		middle=$EPOCHREALTIME
+		SSHELL_SLS_THREADS=$threads "$SSHELL" -q "$WORK/script" > /dev/null
+		end=$EPOCHREALTIME
+		awk -v s="$start" -v m="$middle" -v e="$end" -v n="$entries" -v runs="$runs" -v t="$threads" \
+			'BEGIN { printf "sls_latency_%dt,%d,%.3f,ms\n", t, n, ((e - m) - (m - s)) / runs * 1e3 }'
+	done
+	start=$EPOCHREALTIME
+	"$SSHELL" -q "$WORK/baseline" > /dev/null
+	middle=$EPOCHREALTIME
+	"$SSHELL" -q "$WORK/sorted" > /dev/null
+	end=$EPOCHREALTIME
+	awk -v s="$start" -v m="$middle" -v e="$end" -v n="$entries" -v runs="$runs" \
+		'BEGIN { printf "sls_latency_sorted,%d,%.3f,ms\n", n, ((e - m) - (m - s)) / runs * 1e3 }'
+	cd - > /dev/null
+	rm -rf "$dir"
+done
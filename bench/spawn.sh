@@ -0,0 +1,27 @@
+#!/bin/bash
+# Spawn latency benchmark.
+# Runs a script of BENCH_SPAWN_COUNT "/bin/true" command lines, each a one-stage
+# pipeline launched and reaped by RunAllCmd, and prints CSV rows of the mean
+# microseconds per command for the posix_spawn and fork launchers. The full path
+# keeps the shell's own true builtin out of the way.
+# Usage: bench/spawn.sh [sshell binary]
+set -e
+SSHELL=${1:-./sshell}
+COUNT=${BENCH_SPAWN_COUNT:-$([ -n "$BENCH_QUICK" ] && echo 1000 || echo 10000)}
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+for ((i = 0; i < COUNT; i++)); do echo /bin/true; done > "$WORK/script"
+# An empty script measures the shell's own startup, which is subtracted.
+: > "$WORK/empty"
+
+echo "benchmark,parameter,value,unit"
+for mode in spawn fork; do
+	start=$EPOCHREALTIME
+	SSHELL_LAUNCHER=$mode "$SSHELL" -q "$WORK/empty"
+	middle=$EPOCHREALTIME
+	SSHELL_LAUNCHER=$mode "$SSHELL" -q "$WORK/script"
+	end=$EPOCHREALTIME
+	awk -v s="$start" -v m="$middle" -v e="$end" -v n="$COUNT" -v name="$mode" \
+		'BEGIN { printf "spawn_latency_%s,%d,%.1f,us\n", name, n, ((e - m) - (m - s)) / n * 1e6 }'
+done
@@ -1,84 +1,512 @@
+#define _GNU_SOURCE
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
-#define CMDLINE_MAX 512
-#define TKN_MAX 32
-#define ARGS_MAX 16
-#define PIPED_CMD_MAX 4
+#define ARENA_BLOCK_SIZE 4096
+#define READER_BLOCK_SIZE (64 * 1024)
+
+extern char **environ;
+
+// ARENA
+// Bump-pointer allocator holding everything built from one command line.
+// Blocks are kept when the arena is reset, so the steady state does no malloc/free.
+struct ArenaBlock
+{
+	struct ArenaBlock *next;
+	size_t size;
+	size_t used;
+	max_align_t data[];
+};
+
+struct Arena
+{
+	struct ArenaBlock *first;
+	struct ArenaBlock *current;
+	// Most recent allocation, which ArenaGrow can extend in place.
+	char *last;
+};
+
+// Returns size bytes from the arena, moving to the next kept block or adding one when full.
+void *ArenaAlloc(struct Arena *arena, size_t size)
+{
+	size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+	struct ArenaBlock *block = arena->current;
+
+	while (block == NULL || block->used + size > block->size)
+	{
+		if (block && block->next)
+		{
+			block = block->next;
+			continue;
+		}
+		size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		struct ArenaBlock *new_block = malloc(sizeof(struct ArenaBlock) + block_size);
+		if (new_block == NULL)
+		{
+			perror("malloc");
+			exit(1);
+		}
+		new_block->next = NULL;
+		new_block->size = block_size;
+		new_block->used = 0;
+		if (block) block->next = new_block;
+		else arena->first = new_block;
+		block = new_block;
+	}
+
+	arena->current = block;
+	arena->last = (char *) block->data + block->used;
+	block->used += size;
+	return arena->last;
+}
+
+// Resizes an allocation, in place when it is the most recent one and still fits its block.
+void *ArenaGrow(struct Arena *arena, void *ptr, size_t old_size, size_t new_size)
+{
+	struct ArenaBlock *block = arena->current;
+	if (ptr && ptr == arena->last)
+	{
+		size_t start = (char *) ptr - (char *) block->data;
+		size_t size = (new_size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+		if (start + size <= block->size)
+		{
+			block->used = start + size;
+			return ptr;
+		}
+	}
+	void *new_ptr = ArenaAlloc(arena, new_size);
+	if (ptr) memcpy(new_ptr, ptr, old_size);
+	return new_ptr;
+}
+
+// Releases every allocation at once while keeping the blocks for the next command line.
+void ArenaReset(struct Arena *arena)
+{
+	for (struct ArenaBlock *block = arena->first; block; block = block->next) block->used = 0;
+	arena->current = arena->first;
+	arena->last = NULL;
+}
+
+// Gives every block back to malloc.
+void ArenaFree(struct Arena *arena)
+{
+	struct ArenaBlock *block = arena->first;
+	while (block)
+	{
+		struct ArenaBlock *next = block->next;
+		free(block);
+		block = next;
+	}
+	*arena = (struct Arena) { NULL, NULL, NULL };
+}
+
+// COMMAND CACHE
+// Maps command names to their resolved absolute paths, like bash's hash table,
+// so commands can be exec'd directly instead of probing every $PATH directory.
+#define HASH_BUCKETS 64
+
+struct HashEntry
+{
+	struct HashEntry *next;
+	char *name;
+	char *path;
+	int hits;
+};
+
+struct CommandCache
+{
+	struct HashEntry *buckets[HASH_BUCKETS];
+	// Copy of $PATH the entries were resolved against, NULL if unset.
+	char *path_env;
+	int num_entries;
+};
+
+struct CommandCache cmd_cache;
+
+// FNV-1a hash of a command name.
+unsigned int HashName(const char *name)
+{
+	unsigned int hash = 2166136261u;
+	for (; *name; name++)
+	{
+		hash ^= (unsigned char) *name;
+		hash *= 16777619u;
+	}
+	return hash % HASH_BUCKETS;
+}
+
+// Frees every cached entry.
+void ClearCache(void)
+{
+	for (int i = 0; i < HASH_BUCKETS; i++)
+	{
+		struct HashEntry *entry = cmd_cache.buckets[i];
+		while (entry)
+		{
+			struct HashEntry *next = entry->next;
+			free(entry->name);
+			free(entry->path);
+			free(entry);
+			entry = next;
+		}
+		cmd_cache.buckets[i] = NULL;
+	}
+	cmd_cache.num_entries = 0;
+}
+
+// Drops the whole cache if $PATH changed since the entries were resolved.
+void CheckPathChange(void)
+{
+	char *path_env = getenv("PATH");
+	if (path_env == NULL && cmd_cache.path_env == NULL) return;
+	if (path_env && cmd_cache.path_env && !strcmp(path_env, cmd_cache.path_env)) return;
+
+	ClearCache();
+	free(cmd_cache.path_env);
+	cmd_cache.path_env = path_env ? strdup(path_env) : NULL;
+}
+
+// Searches $PATH for an executable regular file called name.
+// Returns 1 and fills resolved on success, 0 if nothing was found.
+// REF: execvp(3), which uses the same default search path.
+int ResolvePath(const char *name, char *resolved)
+{
+	const char *dir = cmd_cache.path_env ? cmd_cache.path_env : "/bin:/usr/bin";
+	struct stat file_info;
+
+	while (1)
+	{
+		const char *end = strchr(dir, ':');
+		int dir_len = end ? (int) (end - dir) : (int) strlen(dir);
+
+		// An empty entry means the current directory.
+		if (dir_len == 0)
+			snprintf(resolved, PATH_MAX, "%s", name);
+		else
+			snprintf(resolved, PATH_MAX, "%.*s/%s", dir_len, dir, name);
+		if (!stat(resolved, &file_info) && S_ISREG(file_info.st_mode) && !access(resolved, X_OK))
+			return 1;
+
+		if (!end) return 0;
+		dir = end + 1;
+	}
+}
+
+// Finds the cache entry for name, or NULL.
+struct HashEntry *FindCommand(const char *name)
+{
+	struct HashEntry *entry = cmd_cache.buckets[HashName(name)];
+	while (entry && strcmp(entry->name, name)) entry = entry->next;
+	return entry;
+}
+
+// Removes name from the cache. Returns 1 if it was cached.
+int ForgetCommand(const char *name)
+{
+	struct HashEntry **link = &cmd_cache.buckets[HashName(name)];
+	while (*link)
+	{
+		struct HashEntry *entry = *link;
+		if (!strcmp(entry->name, name))
+		{
+			*link = entry->next;
+			free(entry->name);
+			free(entry->path);
+			free(entry);
+			cmd_cache.num_entries--;
+			return 1;
+		}
+		link = &entry->next;
+	}
+	return 0;
+}
+
+// Returns the absolute path to exec for a command name, resolving and caching it on a miss.
+// Names containing a slash are used as is. Returns NULL if the command does not exist.
+const char *LookupCommand(const char *name)
+{
+	char resolved[PATH_MAX];
+	if (strchr(name, '/')) return name;
+
+	CheckPathChange();
+	struct HashEntry *entry = FindCommand(name);
+	if (entry)
+	{
+		entry->hits++;
+		return entry->path;
+	}
+	if (!ResolvePath(name, resolved)) return NULL;
+
+	unsigned int bucket = HashName(name);
+	entry = malloc(sizeof(struct HashEntry));
+	entry->name = strdup(name);
+	entry->path = strdup(resolved);
+	entry->hits = 1;
+	entry->next = cmd_cache.buckets[bucket];
+	cmd_cache.buckets[bucket] = entry;
+	cmd_cache.num_entries++;
+	return entry->path;
+}
+
+// TRACING
+// With SSHELL_TRACE=file, each phase of a command line is appended to file as a
+// Chrome trace event, loadable in Perfetto or chrome://tracing. The file is a JSON
+// array whose closing bracket is left out, which both viewers accept, so children
+// can append events too. Every event is one write() to an O_APPEND descriptor, so
+// events from concurrent processes never interleave. Timestamps are CLOCK_MONOTONIC
+// in microseconds with nanosecond digits.
+// REF: "Trace Event Format", Chromium catapult docs.
+int trace_fd = -1;
+
+// Opens the file named by SSHELL_TRACE, starting the array if the file is new.
+void InitTrace(void)
+{
+	char *path = getenv("SSHELL_TRACE");
+	if (path == NULL || path[0] == '\0') return;
+	trace_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (trace_fd == -1)
+	{
+		fprintf(stderr, "Error: cannot open trace file\n");
+		return;
+	}
+	struct stat file_info;
+	if (!fstat(trace_fd, &file_info) && file_info.st_size == 0) write(trace_fd, "[\n", 2);
+}
+
+// Appends one event. Phase 'X' spans start to end, phase 'i' happens at start.
+// The event is attributed to process pid; cmd_order is -1 for whole command lines,
+// and status is only recorded when it is not -1.
+void TraceEvent(const char *name, char phase, struct timespec start, struct timespec end,
+	pid_t pid, int cmd_order, int status)
+{
+	if (trace_fd == -1) return;
+
+	char event[256];
+	int length = snprintf(event, sizeof(event),
+		"{\"name\":\"%s\",\"cat\":\"sshell\",\"ph\":\"%c\",\"ts\":%lld.%03ld,",
+		name, phase, (long long) start.tv_sec * 1000000 + start.tv_nsec / 1000, start.tv_nsec % 1000);
+	if (phase == 'X')
+	{
+		long long duration = (end.tv_sec - start.tv_sec) * 1000000000LL + end.tv_nsec - start.tv_nsec;
+		length += snprintf(event + length, sizeof(event) - length, "\"dur\":%lld.%03lld,",
+			duration / 1000, duration % 1000);
+	}
+	else
+		length += snprintf(event + length, sizeof(event) - length, "\"s\":\"p\",");
+	length += snprintf(event + length, sizeof(event) - length,
+		"\"pid\":%d,\"tid\":%d,\"args\":{\"cmd_order\":%d", (int) pid,
+		pid == getpid() ? (int) gettid() : (int) pid, cmd_order);
+	if (status != -1)
+		length += snprintf(event + length, sizeof(event) - length, ",\"exit_status\":%d", status);
+	length += snprintf(event + length, sizeof(event) - length, "}},\n");
+	write(trace_fd, event, length);
+}
+
+// Appends a span that started at start and ends now.
+void TraceSpan(const char *name, struct timespec start, int cmd_order)
+{
+	if (trace_fd == -1) return;
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	TraceEvent(name, 'X', start, end, getpid(), cmd_order, -1);
+}
+
+// Returns the current CLOCK_MONOTONIC time.
+struct timespec Now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now;
+}
+
+// close_range(2) and posix_spawn_file_actions_addclosefrom_np(3) came with glibc 2.34.
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 34)
+#define HAVE_CLOSE_RANGE 1
+#endif
+
+// Closes every FD above stderr except the trace file, which children keep until exec.
+// REF: close_range(2)
+void SweepFds(void)
+{
+#ifdef HAVE_CLOSE_RANGE
+	if (trace_fd > STDERR_FILENO)
+	{
+		if (trace_fd > STDERR_FILENO + 1) close_range(STDERR_FILENO + 1, trace_fd - 1, 0);
+		close_range(trace_fd + 1, ~0U, 0);
+	}
+	else
+		close_range(STDERR_FILENO + 1, ~0U, 0);
+#else
+	// One close per possible FD: slower, but only without close_range.
+	long max_fd = sysconf(_SC_OPEN_MAX);
+	for (int fd = STDERR_FILENO + 1; fd < max_fd; fd++)
+		if (fd != trace_fd) close(fd);
+#endif
+}
 
 // EXECUTION
 struct Command
 {
-	// Arguments are to be used for exec().
+	// NULL terminated arguments to be used for exec().
 	// arguments[0] is the command name.
-	char arguments[ARGS_MAX + 1][TKN_MAX];
+	char **arguments;
 	int num_args;
+	int max_args;
 	// The file name and FD to which output goes.
-	char output_name[TKN_MAX];
+	char *output_name;
 	int output_dest;
 	// Does the command write stdout to a file?
 	int output_to_file;
 	// Does the command write stderr to a file/pipe?
 	int err_to_file;
 	int err_to_pipe;
+	// Process running the command, -1 if it could not be launched.
+	pid_t pid;
 	// Reported to stderr at the end of execution.
 	int exit_status;
+	// CLOCK_MONOTONIC times at which the stage was launched and reaped.
+	struct timespec start_time;
+	struct timespec end_time;
+	// Resources used by the stage, from wait4().
+	struct rusage usage;
 };
 
 // Data set of Command objects.
 struct CommandSet
 {
-	struct Command commands[PIPED_CMD_MAX];
+	struct Command *commands;
 	int num_cmd;
+	int max_cmd;
+	// Does the command line end with "&"?
+	int background;
+	// Process group of a background pipeline, 0 until its first stage is launched.
+	pid_t pgid;
+	// Print per-stage resource usage with the completion message?
+	int timed;
+	// Backs the commands, their arguments and the pipes. Reset after every command line.
+	struct Arena arena;
 };
 
 // Data set to keep track of pipelines.
+// Pipes are created lazily as stages are launched, so only the pipe of the stage
+// being launched and the read end left by the previous stage are ever open.
 struct PipeEnv
 {
-	int pipes[PIPED_CMD_MAX - 1][2];
-	int num_pipes;
+	// Read end of the previous stage's pipe, -1 for the first stage.
+	int read_fd;
+	// The current stage's pipe, -1 for the last stage.
+	int pipe_fds[2];
 };
 
-// Create pipelines based on the number of pipes the command has.
-void OpenPipes(struct PipeEnv *pipeSet)
+// Capacity applied to every pipe with F_SETPIPE_SZ, 0 to keep the kernel default.
+// Set from SSHELL_PIPESIZE at startup or with "set pipesize".
+int pipe_size = 0;
+
+// Reads a size in bytes with an optional k, m or g suffix, for pipe sizes and
+// sls -m. Returns -1 if it is not a number, or if it is negative or above max.
+long long ParseSize(const char *text, long long max)
 {
-	for (int i = 0; i < pipeSet->num_pipes; i++)
+	char *end;
+	errno = 0;
+	long long size = strtoll(text, &end, 10);
+	int shift = 0;
+	if (end == text || size < 0 || errno == ERANGE) return -1;
+	switch (*end)
 	{
-		pipe(pipeSet->pipes[i]);
+		case 'k': case 'K': shift = 10; end++; break;
+		case 'm': case 'M': shift = 20; end++; break;
+		case 'g': case 'G': shift = 30; end++; break;
 	}
+	// Bound the count before scaling it so the shift cannot overflow.
+	if (*end != '\0' || size > max >> shift) return -1;
+	return size << shift;
 }
 
-// Cleanup function to close all pipe FDs.
-void ClosePipes(struct PipeEnv *pipeSet)
+// Parses a pipe size such as 65536, 64k, 1m, "max" (the limit in
+// /proc/sys/fs/pipe-max-size) or "default". Returns -1 if it is not valid.
+int ParsePipeSize(const char *text)
 {
-	for (int i = 0; i < pipeSet->num_pipes; i++)
+	if (!strcmp(text, "default")) return 0;
+	if (!strcmp(text, "max"))
 	{
-		close(pipeSet->pipes[i][0]);
-		close(pipeSet->pipes[i][1]);
+		int max_size = -1;
+		FILE *limit = fopen("/proc/sys/fs/pipe-max-size", "re");
+		if (limit)
+		{
+			if (fscanf(limit, "%d", &max_size) != 1) max_size = -1;
+			fclose(limit);
+		}
+		return max_size;
 	}
+
+	long long size = ParseSize(text, INT_MAX);
+	return size > 0 ? size : -1;
 }
 
-// Executes the information in a Command object.
-// REF: fork-exec-wait.c, dup2.c
-void RunCommand(struct Command *cmd)
+// Reads SSHELL_PIPESIZE, ignoring values that do not parse.
+void InitPipeSize(void)
+{
+	char *text = getenv("SSHELL_PIPESIZE");
+	if (text && ParsePipeSize(text) >= 0) pipe_size = ParsePipeSize(text);
+}
+
+// Create the pipe of the next stage, unless it is the last one.
+// Pipes are close-on-exec, so children only keep the ends dup2'd onto 0, 1 and 2.
+// Returns 0 if the pipe could not be created.
+int OpenPipe(struct PipeEnv *pipeSet, int last_stage)
 {
-	// Set up arguments for exec function.
-	char *args[1 + cmd->num_args];
-	for (int i = 0; i < cmd->num_args + 1; i++)
+	pipeSet->pipe_fds[0] = pipeSet->pipe_fds[1] = -1;
+	if (last_stage) return 1;
+	if (pipe2(pipeSet->pipe_fds, O_CLOEXEC) == -1)
 	{
-		if (i == cmd->num_args) {
-			args[i] = NULL;
-		} else {
-			args[i] = cmd->arguments[i];
-		}
-	}	
-	
+		perror("pipe");
+		return 0;
+	}
+	// A size the kernel refuses (over the limit, no permission) keeps the default.
+	// REF: pipe(7), "Pipe capacity"
+	if (pipe_size > 0) fcntl(pipeSet->pipe_fds[1], F_SETPIPE_SZ, pipe_size);
+	return 1;
+}
+
+// Parent side of a launched stage: drop the FDs now owned by the child and keep the
+// read end of the new pipe for the next stage.
+void AdvancePipe(struct PipeEnv *pipeSet)
+{
+	if (pipeSet->read_fd != -1) close(pipeSet->read_fd);
+	if (pipeSet->pipe_fds[1] != -1) close(pipeSet->pipe_fds[1]);
+	pipeSet->read_fd = pipeSet->pipe_fds[0];
+}
+
+// Connects a forked child's stdout (and stderr for >&) to the Command's output file.
+// REF: dup2.c
+void RedirectOutput(struct Command *cmd)
+{
 	if (cmd->output_to_file) 
 	{
 		cmd->output_dest = open(cmd->output_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
@@ -87,430 +515,2872 @@ void RunCommand(struct Command *cmd)
 		if (cmd->err_to_file) dup2(cmd->output_dest, STDERR_FILENO);
 		close(cmd->output_dest);
 	}
+}
+
+// Executes the information in a Command object.
+// path is the cached location of the command, or NULL to let execvp search $PATH.
+// REF: fork-exec-wait.c
+void RunCommand(struct Command *cmd, const char *path, int cmd_order)
+{
+	// Arguments are already NULL terminated for the exec function.
+	char **args = cmd->arguments;
+
+	RedirectOutput(cmd);
+	struct timespec now = Now();
+	TraceEvent("exec", 'i', now, now, getpid(), cmd_order, -1);
 
 	// Actual execution of command. Fork ends here.
+	// A stale cache entry falls through to the regular $PATH search.
+	if (path) execve(path, args, environ);
 	execvp(cmd->arguments[0], args);
 	// If still here, exec failed due to invalid command name.
 	fprintf(stderr, "Error: command not found\n");
 	exit(1);
 }
 
-// Runs all Commands in a CommandSet after setting up pipes.
-// REF: fork-exec-wait.c, "Process pipeline example" (Syscalls p. 37)
-void RunAllCmd(struct CommandSet *allCmd, struct PipeEnv *pipeSet)
+// RELAY STAGES
+// Stages that only move bytes, cat and tee, are run by a forked copy of the shell
+// instead of exec'ing /bin/cat or /bin/tee. Data is moved with splice(2) and tee(2),
+// so it never passes through user space when one end is a pipe. Anything splice
+// does not support, like a terminal, falls back to a read/write loop.
+#define RELAY_CHUNK (1024 * 1024)
+#define RELAY_BUFFER_SIZE (128 * 1024)
+
+enum RelayKinds
 {
-	// Identifier for forks to realize what number command they are.
-	int cmd_order;
-	// Array of fork ids, forkId[x] = 0 for command x's fork.
-	pid_t forkIds[4];
+	RELAY_NONE,
+	RELAY_CAT,
+	RELAY_TEE
+};
 
-	OpenPipes(pipeSet);
+// Set from SSHELL_RELAY at startup or with "set relay on|off".
+int relay_stages = 1;
 
-	// Create a child for every command.
-	for (int i = 0; i < allCmd->num_cmd; i++)
+// Decides whether a Command can run as a relay stage.
+// Only option-free cat and tee (plus tee -a) are handled; anything else is exec'd.
+int RelayKind(struct Command *cmd)
+{
+	int first_file = 1;
+	int kind = RELAY_NONE;
+	if (!relay_stages) return RELAY_NONE;
+
+	if (!strcmp(cmd->arguments[0], "cat"))
+		kind = RELAY_CAT;
+	else if (!strcmp(cmd->arguments[0], "tee"))
 	{
-		cmd_order = i;
-		forkIds[i] = fork();
-		// Prevents children from forking.
-		if (forkIds[i] == 0) break;
+		kind = RELAY_TEE;
+		if (cmd->num_args > 1 && !strcmp(cmd->arguments[1], "-a")) first_file = 2;
 	}
+	else
+		return RELAY_NONE;
 
-	if (forkIds[cmd_order] == 0)
-	{
-		// Child: connect the requisite pipes then run command.
-		// Set write pipe FD except for last command.
-		if (allCmd->num_cmd - 1 > cmd_order)
-		{
-			dup2(pipeSet->pipes[cmd_order][1], STDOUT_FILENO);
-		}
+	for (int i = first_file; i < cmd->num_args; i++)
+		if (cmd->arguments[i][0] == '-' && strcmp(cmd->arguments[i], "-")) return RELAY_NONE;
+	return kind;
+}
 
-		// Set read pipe FD except for first command.
-		if (cmd_order > 0)
+// Writes all of buffer, returns -1 on error.
+int WriteAll(int fd, const char *buffer, size_t length)
+{
+	while (length > 0)
+	{
+		ssize_t written = write(fd, buffer, length);
+		if (written < 0)
 		{
-			dup2(pipeSet->pipes[cmd_order - 1][0], STDIN_FILENO);
+			if (errno == EINTR) continue;
+			return -1;
 		}
+		buffer += written;
+		length -= written;
+	}
+	return 0;
+}
 
-		// Set stderr to write pipe FD if requested.
-		if (allCmd->commands[cmd_order].err_to_pipe)
-		{
-			dup2(pipeSet->pipes[cmd_order][1], STDERR_FILENO);
-		}
-		
-		// Close misc pipe FDs and pipe FDs no longer in use.
-		ClosePipes(pipeSet);
-		RunCommand(&allCmd->commands[cmd_order]);
-	} else {
-		// Parent: Wait for every child in order of FIFO.
-		// Then save exit status to all Command Objects.
-		// REF: Piazza @63 (thanks professor!)
-		ClosePipes(pipeSet);
-		for (int j = 0; j < allCmd->num_cmd; j++)
+// Copies in to every FD in outs through a user-space buffer until end of input.
+// Returns 0 on success, -1 on a read or write error.
+int CopyBuffered(int in, const int *outs, int num_outs)
+{
+	static char buffer[RELAY_BUFFER_SIZE];
+	while (1)
+	{
+		ssize_t bytes = read(in, buffer, sizeof(buffer));
+		if (bytes == 0) return 0;
+		if (bytes < 0)
 		{
-			int status;
-			waitpid(forkIds[j], &status, 0);
-			allCmd->commands[j].exit_status = WEXITSTATUS(status);	
+			if (errno == EINTR) continue;
+			return -1;
 		}
+		for (int i = 0; i < num_outs; i++)
+			if (WriteAll(outs[i], buffer, bytes)) return -1;
 	}
 }
 
-// PARSING
-// ParseModes determine behavior of parser when encountering certain symbols.
-enum ParseModes {
-	// Building the argument of a command.
-	SEARCH_COMMAND,
-	// Building an output filename.
-	SEARCH_FILENAME
-};
-
-enum ParsingErrors
+// Result of a copy strategy that may not apply to the FDs it was given.
+enum CopyResults
 {
-	MISSING_TOKEN, // Missing output file or command
-	BAD_FILE, // Can't open file
-	ARG_OVERFLOW, // Too many arguments
-	PIPE_OVERFLOW, // Too many pipes
-	MISLOCATED_REDIRECT // Mislocated output
+	COPY_DONE = 0,
+	COPY_ERROR = -1,
+	// The FDs do not support this strategy, try the next one.
+	COPY_UNSUPPORTED = 1
 };
 
-// Parsing error reporting system.
-// REF: "project1.pdf" slide 34.
-void ParsingError(int error_code, int read_mode) 
+// Copies between two regular files inside the kernel, which also lets filesystems
+// such as btrfs and XFS share the extents instead of copying.
+// REF: copy_file_range(2)
+int CopyFileRange(int in, int out)
 {
-	switch(error_code)
+	while (1)
 	{
-		case MISSING_TOKEN:
-			if (read_mode == SEARCH_COMMAND) fprintf(stderr, "Error: missing command\n");
-			if (read_mode == SEARCH_FILENAME) fprintf(stderr, "Error: no output file\n");
-			break;
-		case BAD_FILE:
-			fprintf(stderr, "Error: cannot open output file\n");
-			break;
-		case ARG_OVERFLOW:
-			fprintf(stderr, "Error: too many process arguments\n");
-			break;
-		case PIPE_OVERFLOW:
-			fprintf(stderr, "Error: too many pipes\n");
-			break;
-		case MISLOCATED_REDIRECT:
-			fprintf(stderr, "Error: mislocated output redirection\n");
-			break;
-		default:
-			break;
+		ssize_t bytes = copy_file_range(in, NULL, out, NULL, RELAY_CHUNK * 16, 0);
+		if (bytes > 0) continue;
+		if (bytes == 0) return COPY_DONE;
+		if (errno == EINTR) continue;
+		// Older kernels refuse cross-filesystem copies, some filesystems any copy,
+		// and an output opened with O_APPEND fails with EBADF.
+		if (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP ||
+			errno == EBADF)
+			return COPY_UNSUPPORTED;
+		return COPY_ERROR;
 	}
 }
 
-// Checks that a particular file can be opened.
-int VerifyFile(char *filename)
+// Copies from a regular file to any FD inside the kernel.
+// REF: sendfile(2)
+int SendFile(int in, int out)
 {
-	int open_file = 0;
-	open_file = open(filename, O_WRONLY | O_CREAT, 0644);
-	if (open_file == -1)
+	while (1)
 	{
-		ParsingError(BAD_FILE, 0);
-		return 0;
+		ssize_t bytes = sendfile(out, in, NULL, RELAY_CHUNK * 16);
+		if (bytes > 0) continue;
+		if (bytes == 0) return COPY_DONE;
+		if (errno == EINTR) continue;
+		if (errno == EINVAL || errno == ENOSYS || errno == EBADF) return COPY_UNSUPPORTED;
+		return COPY_ERROR;
 	}
-	close(open_file);
-	return 1;
 }
 
-// Copies a token string to a target string location.
-int CopyToken(char *segment, char *target, int *length, int read_mode)
+// Moves everything from in to out without user-space copies where the kernel allows:
+// copy_file_range between regular files, sendfile from a regular file, splice when
+// either end is a pipe, and finally a read/write loop. Every strategy works from the
+// current file offsets, so a later one picks up where an earlier one stopped.
+// Returns 0 on success, -1 on error.
+// REF: splice(2)
+int CopyFd(int in, int out)
 {
-	// If no token was read, raise a missing command/file error.
-	if (*length == 0)
+	struct stat in_info;
+	struct stat out_info;
+	int result = COPY_UNSUPPORTED;
+
+	if (!fstat(in, &in_info) && S_ISREG(in_info.st_mode) && !fstat(out, &out_info))
 	{
-		ParsingError(MISSING_TOKEN, read_mode);
-		return 0;
+		if (S_ISREG(out_info.st_mode)) result = CopyFileRange(in, out);
+		if (result == COPY_UNSUPPORTED) result = SendFile(in, out);
+		if (result != COPY_UNSUPPORTED) return result;
 	}
 
-	// If token is a file name, verify that the file can be opened.
-	if (read_mode == SEARCH_FILENAME)
-		if (!VerifyFile(segment)) return 0;
+	while (1)
+	{
+		ssize_t bytes = splice(in, NULL, out, NULL, RELAY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (bytes > 0) continue;
+		if (bytes == 0) return 0;
+		if (errno == EINTR) continue;
+		// Neither end is a pipe or the file type cannot splice.
+		if (errno == EINVAL) return CopyBuffered(in, &out, 1);
+		return -1;
+	}
+}
 
-	// Copy to target then flush the token.
-	strcpy(target, segment);
-	// REF: https://stackoverflow.com/questions/1735919/whats-the-best-way-to-reset-a-char-in-c
-	memset(segment, '\0', TKN_MAX);
-	*length = 0;
-	return 1;
+// cat: copies the named files (stdin for none or "-") to stdout.
+int RelayCat(struct Command *cmd)
+{
+	int status = 0;
+	int num_files = cmd->num_args - 1;
+	for (int i = 0; i < (num_files ? num_files : 1); i++)
+	{
+		char *name = num_files ? cmd->arguments[i + 1] : "-";
+		int in = STDIN_FILENO;
+		if (strcmp(name, "-")) in = open(name, O_RDONLY | O_CLOEXEC);
+		if (in == -1 || CopyFd(in, STDOUT_FILENO))
+		{
+			fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+			status = 1;
+		}
+		if (in > STDERR_FILENO) close(in);
+	}
+	return status;
 }
 
-// Initialize Command Object values.
-void InitCommand(struct Command *cmd)
+// Duplicates a pipe on stdin to a pipe on stdout with tee(2), then moves the same bytes
+// into file with splice(2), so neither copy touches user space.
+// Returns 0 on success, -1 if the FDs do not support it before any data moved.
+// REF: tee(2), the example in its man page.
+int TeeSplice(int file)
 {
-	cmd->output_dest = STDOUT_FILENO;
-	strcpy(cmd->output_name, " ");
-	cmd->output_to_file = 0;
-	cmd->err_to_pipe = 0;
-	cmd->err_to_file = 0;
-	cmd->num_args = 0;
-	cmd->exit_status = 0;
+	int moved = 0;
+	while (1)
+	{
+		ssize_t bytes = tee(STDIN_FILENO, STDOUT_FILENO, RELAY_CHUNK, 0);
+		if (bytes == 0) return 0;
+		if (bytes < 0)
+		{
+			if (errno == EINTR) continue;
+			return moved ? 1 : -1;
+		}
+		moved = 1;
+		// Consume exactly what was duplicated.
+		while (bytes > 0)
+		{
+			ssize_t spliced = splice(STDIN_FILENO, NULL, file, NULL, bytes, SPLICE_F_MOVE);
+			if (spliced <= 0)
+			{
+				if (spliced < 0 && errno == EINTR) continue;
+				return 1;
+			}
+			bytes -= spliced;
+		}
+	}
 }
 
-// Runs through the command line character by character, splitting it into Command Objects.
-// Works by building a read string then copying it to a piece of a Command Object.
-int ParseCmd(struct CommandSet *allCmd, struct PipeEnv *pipeSet, char *cmd)
+// tee [-a] [file...]: copies stdin to stdout and every file.
+int RelayTee(struct Command *cmd)
 {
-	// Flushable token to be copied to a target location.
-	char segment[TKN_MAX];
-	char *target;
-	int length = 0;
+	int status = 0;
+	int first_file = 1;
+	int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+	if (cmd->num_args > 1 && !strcmp(cmd->arguments[1], "-a"))
+	{
+		first_file = 2;
+		flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+	}
 
-	// "Reading mode" to determine where fully read tokens go.
-	int read_mode = SEARCH_COMMAND;
+	// stdout first, then every file that opened. Like GNU tee, "-" is a file name.
+	int outs[cmd->num_args];
+	int num_outs = 0;
+	outs[num_outs++] = STDOUT_FILENO;
+	for (int i = first_file; i < cmd->num_args; i++)
+	{
+		int fd = open(cmd->arguments[i], flags, 0644);
+		if (fd == -1)
+		{
+			fprintf(stderr, "tee: %s: %s\n", cmd->arguments[i], strerror(errno));
+			status = 1;
+			continue;
+		}
+		outs[num_outs++] = fd;
+	}
 
-	// If the parser runs through whitespace while looking for a command.
-	int encounter_whitespace = 0;
-	int init_skip = 1;
+	// The zero-copy path covers the common fan-out of one file next to a pipe.
+	if (num_outs == 1) return CopyFd(STDIN_FILENO, STDOUT_FILENO) ? 1 : status;
+	// splice(2) refuses files opened with O_APPEND, which tee -a uses.
+	if (num_outs == 2 && !(fcntl(outs[1], F_GETFL) & O_APPEND))
+	{
+		int result = TeeSplice(outs[1]);
+		if (result >= 0) return result ? 1 : status;
+	}
+	if (CopyBuffered(STDIN_FILENO, outs, num_outs))
+	{
+		perror("tee");
+		return 1;
+	}
+	return status;
+}
 
-	// Initialize Command Set and Pipe Environment variables.
-	// Initial target is the first argument of the first Command.
-	allCmd->num_cmd = 0;
-	pipeSet->num_pipes = 0;
-	InitCommand(&allCmd->commands[allCmd->num_cmd]);
-	target = allCmd->commands[allCmd->num_cmd].arguments[0];
+// Tells whether a Command is "cat file... > out", which the shell copies itself
+// without a process or a pipe.
+int IsFileCopy(struct Command *cmd)
+{
+	if (RelayKind(cmd) != RELAY_CAT || !cmd->output_to_file || cmd->num_args < 2) return 0;
+	for (int i = 1; i < cmd->num_args; i++)
+		if (!strcmp(cmd->arguments[i], "-")) return 0;
+	return 1;
+}
 
-	// Initialize the parsing token.
-	// REF: https://stackoverflow.com/questions/1735919/whats-the-best-way-to-reset-a-char-in-c
-	memset(segment, '\0', TKN_MAX);
+// Runs "cat file... > out" inside the shell. The first file is reflinked with FICLONE
+// when the filesystem supports it, everything else goes through CopyFd.
+// Returns the exit status cat would have.
+// REF: ioctl_ficlone(2)
+int CopyToFile(struct Command *cmd)
+{
+	struct stat in_info;
+	struct stat out_info;
+	int status = 0;
 
-	for (int i = 0; i < (int) strlen(cmd); i++)
+	int out = open(cmd->output_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (out == -1 || fstat(out, &out_info))
 	{
-		char read_char = cmd[i];
-		switch(read_char)
-		{
-			case '|':
-				// Attempt to copy token to target location.
-				if (!CopyToken(segment, target, &length, read_mode)) return 1;
-				if (read_mode == SEARCH_COMMAND) allCmd->commands[allCmd->num_cmd].num_args++;
+		fprintf(stderr, "Error: cannot open output file\n");
+		if (out != -1) close(out);
+		return 1;
+	}
+	// With >& cat's errors belong in the file too.
+	int err = cmd->err_to_file ? out : STDERR_FILENO;
 
-				// Make sure within 16 argument threshold.
-				if (allCmd->commands[allCmd->num_cmd].num_args > ARGS_MAX)
+	for (int i = 1; i < cmd->num_args; i++)
+	{
+		char *name = cmd->arguments[i];
+		int in = open(name, O_RDONLY | O_CLOEXEC);
+		if (in == -1)
+		{
+			dprintf(err, "cat: %s: %s\n", name, strerror(errno));
+			status = 1;
+			continue;
+		}
+		if (!fstat(in, &in_info) && in_info.st_dev == out_info.st_dev && in_info.st_ino == out_info.st_ino)
+		{
+			dprintf(err, "cat: %s: input file is output file\n", name);
+			status = 1;
+		}
+		else if (i == 1 && !ioctl(out, FICLONE, in))
+		{
+			// The clone does not move the file offset, later files are appended.
+			lseek(out, 0, SEEK_END);
+		}
+		else if (CopyFd(in, out))
+		{
+			dprintf(err, "cat: %s: %s\n", name, strerror(errno));
+			status = 1;
+		}
+		close(in);
+	}
+	close(out);
+	return status;
+}
+
+// Runs a relay stage in the forked child and returns its exit status.
+int RunRelay(struct Command *cmd)
+{
+	if (RelayKind(cmd) == RELAY_TEE) return RelayTee(cmd);
+	return RelayCat(cmd);
+}
+
+// Reads SSHELL_RELAY, where 0 turns relay stages off.
+void InitRelay(void)
+{
+	char *mode = getenv("SSHELL_RELAY");
+	if (mode && !strcmp(mode, "0")) relay_stages = 0;
+}
+
+// Set with "set pipefail on|off". When on, a stage that fails terminates the
+// stages upstream of it and the pipeline reports the last failing status.
+int pipefail = 0;
+
+// Signals the shell blocks: SIGCHLD is read from a signalfd and SIGTTOU would stop
+// the shell when it hands the terminal back to itself. Children get an empty mask.
+sigset_t shell_sigmask;
+sigset_t child_sigmask;
+
+// Process launchers used by RunAllCmd.
+// LAUNCH_SPAWN goes through posix_spawn, which glibc implements with
+// clone(CLONE_VM|CLONE_VFORK) so no page tables are copied before the exec.
+// LAUNCH_FORK is the original fork, dup2 then exec path, kept for benchmarking.
+enum Launchers
+{
+	LAUNCH_SPAWN,
+	LAUNCH_FORK
+};
+
+int launcher = LAUNCH_SPAWN;
+
+// Picks the launcher from the SSHELL_LAUNCHER environment variable ("spawn" or "fork").
+void InitLauncher(void)
+{
+	char *mode = getenv("SSHELL_LAUNCHER");
+	if (mode && !strcmp(mode, "fork")) launcher = LAUNCH_FORK;
+#ifndef HAVE_CLOSE_RANGE
+	// posix_spawn could not sweep inherited FDs, which a forked child does itself.
+	launcher = LAUNCH_FORK;
+#endif
+}
+
+// BUILTIN STAGES
+// Builtins are pipeline stages like any other. A builtin that ends a foreground
+// command line runs inside the shell, with its stdin, stdout and stderr pointed at
+// the pipe or file for the duration, so "pwd > file" or "sls > listing" need no
+// fork. Elsewhere in a pipeline a builtin is forked: its reader is only launched
+// after it, so running it in the shell could fill the pipe and never return. The
+// same goes for background lines. Builtins that change the shell's state are only
+// run in the shell when they are the whole command line; in a longer pipeline they
+// are forked and, like in other shells, have no lasting effect.
+// Builtins are looked up in a registry defined after them, below main's helpers.
+enum BuiltinFlags
+{
+	// May run inside the shell when it ends a foreground command line.
+	BUILTIN_FORKLESS = 1,
+	// Changes the shell: the directory, settings, the job table or whether it exits.
+	// Only run inside the shell when it is the whole command line.
+	BUILTIN_STATE = 2
+};
+
+struct Builtin
+{
+	const char *name;
+	// Runs the builtin in the current process and returns its exit status.
+	int (*handler)(struct Command *cmd);
+	int flags;
+};
+
+// Returns the registry entry of a builtin, or NULL. Defined with the registry.
+const struct Builtin *FindBuiltin(const char *name);
+
+// Set at startup when stdout and stderr are the same file, as with "> log 2>&1".
+// Buffered builtin output is then flushed before the shell or a builtin writes an
+// error, so the file reads in the order things happened.
+int shared_stderr = 0;
+
+// Can this stage run inside the shell?
+int RunsInShell(struct CommandSet *allCmd, int cmd_order)
+{
+	const struct Builtin *builtin = FindBuiltin(allCmd->commands[cmd_order].arguments[0]);
+	if (builtin == NULL || allCmd->background) return 0;
+	if (cmd_order != allCmd->num_cmd - 1 || !(builtin->flags & BUILTIN_FORKLESS)) return 0;
+	return allCmd->num_cmd == 1 || !(builtin->flags & BUILTIN_STATE);
+}
+
+// Runs a builtin stage inside the shell with its standard FDs moved to the stage's
+// pipe and output file, then puts the shell's own FDs back.
+int RunBuiltinStage(struct Command *cmd, struct PipeEnv *pipeSet)
+{
+	int saved[3] = { -1, -1, -1 };
+	int output_fd = -1;
+	if (cmd->output_to_file)
+	{
+		output_fd = open(cmd->output_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (output_fd == -1)
+		{
+			fprintf(stderr, "Error: cannot open output file\n");
+			return 1;
+		}
+	}
+
+	// Anything the shell printed so far goes out before stdout moves, or before the
+	// builtin's errors when they share a file.
+	if (output_fd != -1 || shared_stderr) fflush(stdout);
+	if (pipeSet->read_fd != -1)
+	{
+		saved[STDIN_FILENO] = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+		dup2(pipeSet->read_fd, STDIN_FILENO);
+	}
+	if (output_fd != -1)
+	{
+		saved[STDOUT_FILENO] = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+		dup2(output_fd, STDOUT_FILENO);
+		// >&, connect STDERR as well.
+		if (cmd->err_to_file)
+		{
+			saved[STDERR_FILENO] = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0);
+			dup2(output_fd, STDERR_FILENO);
+		}
+		close(output_fd);
+	}
+
+	int status = FindBuiltin(cmd->arguments[0])->handler(cmd);
+
+	// Output to the terminal or the shell's stdout may stay buffered: runs of builtins
+	// like echo then share writes, and the buffer is flushed before anything else
+	// writes to stdout.
+	if (output_fd != -1) fflush(stdout);
+	for (int fd = STDIN_FILENO; fd <= STDERR_FILENO; fd++)
+	{
+		if (saved[fd] == -1) continue;
+		dup2(saved[fd], fd);
+		close(saved[fd]);
+	}
+	return status;
+}
+
+// Forks a child that connects its pipes then runs the command, or runs it as a
+// relay stage or builtin without exec'ing. Returns the child's pid to the parent.
+pid_t ForkCommand(struct CommandSet *allCmd, struct PipeEnv *pipeSet, int cmd_order)
+{
+	struct Command *cmd = &allCmd->commands[cmd_order];
+	int relay = RelayKind(cmd) != RELAY_NONE;
+	const struct Builtin *builtin = FindBuiltin(cmd->arguments[0]);
+	// Resolve before forking so the cache lives in the parent.
+	// The child cannot report a stale entry back, so a cached path that has
+	// disappeared is forgotten here and $PATH searched once more.
+	const char *path = relay || builtin ? NULL : LookupCommand(cmd->arguments[0]);
+	if (path && path != cmd->arguments[0] && access(path, X_OK) == -1
+		&& ForgetCommand(cmd->arguments[0]))
+		path = LookupCommand(cmd->arguments[0]);
+	pid_t pid = fork();
+	if (pid != 0)
+	{
+		// Also set in the parent so the group exists before the next stage joins it.
+		if (pid > 0 && allCmd->background) setpgid(pid, allCmd->pgid);
+		return pid;
+	}
+
+	// Background stages share a process group of their own.
+	if (allCmd->background) setpgid(0, allCmd->pgid);
+	sigprocmask(SIG_SETMASK, &child_sigmask, NULL);
+
+	// Child: connect the requisite pipes then run command.
+	// Set write pipe FD except for last command.
+	if (pipeSet->pipe_fds[1] != -1)
+	{
+		dup2(pipeSet->pipe_fds[1], STDOUT_FILENO);
+	}
+
+	// Set read pipe FD except for first command.
+	if (pipeSet->read_fd != -1)
+	{
+		dup2(pipeSet->read_fd, STDIN_FILENO);
+	}
+
+	// Set stderr to write pipe FD if requested.
+	if (cmd->err_to_pipe)
+	{
+		dup2(pipeSet->pipe_fds[1], STDERR_FILENO);
+	}
+
+	// Sweep every other FD, pipes and anything else the shell holds, in one call.
+	SweepFds();
+	if (relay)
+	{
+		// _exit so stdio buffers copied from the shell are not flushed twice.
+		RedirectOutput(cmd);
+		_exit(RunRelay(cmd));
+	}
+	if (builtin)
+	{
+		RedirectOutput(cmd);
+		int status = builtin->handler(cmd);
+		fflush(stdout);
+		_exit(status);
+	}
+	RunCommand(cmd, path, cmd_order);
+	// RunCommand never returns.
+	return 0;
+}
+
+// Spawns a command with the same wiring as ForkCommand, expressed as spawn file actions.
+// Returns the child's pid, or -1 if the command could not be started.
+// REF: posix_spawn(3), posix_spawn_file_actions_adddup2(3)
+pid_t SpawnCommand(struct CommandSet *allCmd, struct PipeEnv *pipeSet, int cmd_order)
+{
+	struct Command *cmd = &allCmd->commands[cmd_order];
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attributes;
+	pid_t pid;
+
+	char **args = cmd->arguments;
+
+	// Output files are opened by the parent so open errors are not mistaken for exec errors.
+	int output_file = -1;
+	if (cmd->output_to_file)
+	{
+		output_file = open(cmd->output_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (output_file == -1)
+		{
+			fprintf(stderr, "Error: cannot open output file\n");
+			return -1;
+		}
+	}
+
+	posix_spawn_file_actions_init(&actions);
+	if (pipeSet->pipe_fds[1] != -1)
+		posix_spawn_file_actions_adddup2(&actions, pipeSet->pipe_fds[1], STDOUT_FILENO);
+	if (pipeSet->read_fd != -1)
+		posix_spawn_file_actions_adddup2(&actions, pipeSet->read_fd, STDIN_FILENO);
+	if (cmd->err_to_pipe)
+		posix_spawn_file_actions_adddup2(&actions, pipeSet->pipe_fds[1], STDERR_FILENO);
+	if (output_file != -1)
+	{
+		posix_spawn_file_actions_adddup2(&actions, output_file, STDOUT_FILENO);
+		// >&, connect STDERR as well.
+		if (cmd->err_to_file) posix_spawn_file_actions_adddup2(&actions, output_file, STDERR_FILENO);
+	}
+	// Pipes and the output file are close-on-exec. Anything else the shell
+	// inherited is swept with a single close_range in the child.
+#ifdef HAVE_CLOSE_RANGE
+	posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1);
+#endif
+
+	// Clear the shell's blocked signals, and put background stages in their own group.
+	posix_spawnattr_init(&attributes);
+	posix_spawnattr_setsigmask(&attributes, &child_sigmask);
+	if (allCmd->background)
+	{
+		posix_spawnattr_setpgroup(&attributes, allCmd->pgid);
+		posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP);
+	}
+	else
+		posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK);
+
+	// glibc reports exec failures back to the parent, so the error is raised here.
+	// If a cached path has disappeared, forget it and search $PATH once more.
+	int spawn_error = ENOENT;
+	const char *path = LookupCommand(args[0]);
+	if (path) spawn_error = posix_spawn(&pid, path, &actions, &attributes, args, environ);
+	if (spawn_error == ENOENT && path != args[0] && ForgetCommand(args[0]))
+	{
+		path = LookupCommand(args[0]);
+		if (path) spawn_error = posix_spawn(&pid, path, &actions, &attributes, args, environ);
+	}
+	// An executable without a #! line is a script for /bin/sh, as execvp treats it.
+	// REF: execvp(3), ENOEXEC
+	if (spawn_error == ENOEXEC)
+	{
+		char **sh_args = ArenaAlloc(&allCmd->arena, (cmd->num_args + 2) * sizeof(char *));
+		sh_args[0] = "sh";
+		sh_args[1] = (char *) path;
+		memcpy(sh_args + 2, args + 1, cmd->num_args * sizeof(char *));
+		spawn_error = posix_spawn(&pid, "/bin/sh", &actions, &attributes, sh_args, environ);
+	}
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attributes);
+	if (output_file != -1) close(output_file);
+	if (spawn_error)
+	{
+		if (spawn_error == ENOENT) fprintf(stderr, "Error: command not found\n");
+		else fprintf(stderr, "Error: cannot execute command\n");
+		return -1;
+	}
+	return pid;
+}
+
+// Exit status of a stage as shells report it: 128 plus the signal number for a
+// stage killed by a signal, like 141 for SIGPIPE.
+int StageStatus(int status)
+{
+	return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
+
+// With pipefail, a stage that failed terminates the stages still feeding it.
+void StopUpstream(struct CommandSet *allCmd, int cmd_order)
+{
+	if (!pipefail || allCmd->commands[cmd_order].exit_status == 0) return;
+	for (int j = 0; j < cmd_order; j++)
+		if (allCmd->commands[j].pid > 0) kill(allCmd->commands[j].pid, SIGTERM);
+}
+
+// Saves the exit status of a stage that has exited, its resource usage and end time.
+void ReapCommand(struct CommandSet *allCmd, int cmd_order, int status)
+{
+	struct Command *cmd = &allCmd->commands[cmd_order];
+	clock_gettime(CLOCK_MONOTONIC, &cmd->end_time);
+	cmd->exit_status = StageStatus(status);
+	TraceEvent("reap", 'X', cmd->start_time, cmd->end_time, cmd->pid, cmd_order, cmd->exit_status);
+	cmd->pid = -1;
+	StopUpstream(allCmd, cmd_order);
+}
+
+// Waits for every launched child in order of FIFO.
+// Used when pidfds are not available.
+// REF: Piazza @63 (thanks professor!)
+void WaitCommandsFifo(struct CommandSet *allCmd)
+{
+	for (int j = 0; j < allCmd->num_cmd; j++)
+	{
+		int status;
+		if (allCmd->commands[j].pid <= 0) continue;
+		wait4(allCmd->commands[j].pid, &status, 0, &allCmd->commands[j].usage);
+		ReapCommand(allCmd, j, status);
+	}
+}
+
+// Waits for every launched child in the order they exit, so a late stage that dies
+// is noticed while an earlier one is still running. Each stage gets a pidfd in an
+// epoll set whose event data is the stage's index, and a readable pidfd means that
+// its wait4 will not block.
+// REF: pidfd_open(2), epoll(7)
+void WaitCommands(struct CommandSet *allCmd)
+{
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	int remaining = 0;
+	if (epoll_fd == -1)
+	{
+		WaitCommandsFifo(allCmd);
+		return;
+	}
+
+	// Every pidfd opened, so none outlives the command line.
+	int *pid_fds = malloc(allCmd->num_cmd * sizeof(int));
+	for (int j = 0; j < allCmd->num_cmd; j++) pid_fds[j] = -1;
+	for (int j = 0; j < allCmd->num_cmd; j++)
+	{
+		struct Command *cmd = &allCmd->commands[j];
+		if (cmd->pid <= 0) continue;
+		int pid_fd = syscall(SYS_pidfd_open, cmd->pid, 0);
+		struct epoll_event event = { .events = EPOLLIN, .data.u64 = j };
+		if (pid_fd == -1 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pid_fd, &event) == -1)
+		{
+			// Older kernel or out of FDs: the stages registered so far are still
+			// waited for as they exit, the others in FIFO order after them.
+			if (pid_fd != -1) close(pid_fd);
+			break;
+		}
+		pid_fds[j] = pid_fd;
+		remaining++;
+	}
+
+	struct epoll_event events[16];
+	while (remaining > 0)
+	{
+		int ready = epoll_wait(epoll_fd, events, 16, -1);
+		if (ready < 0 && errno == EINTR) continue;
+		if (ready < 0) break;
+		for (int k = 0; k < ready; k++)
+		{
+			int cmd_order = events[k].data.u64;
+			int status;
+			wait4(allCmd->commands[cmd_order].pid, &status, 0, &allCmd->commands[cmd_order].usage);
+			ReapCommand(allCmd, cmd_order, status);
+			close(pid_fds[cmd_order]);
+			pid_fds[cmd_order] = -1;
+			remaining--;
+		}
+	}
+	for (int j = 0; j < allCmd->num_cmd; j++)
+		if (pid_fds[j] != -1) close(pid_fds[j]);
+	free(pid_fds);
+	close(epoll_fd);
+	// Collects the stages left unregistered, or everything if epoll_wait failed.
+	WaitCommandsFifo(allCmd);
+}
+
+// Exit status of a command line: the last stage's, or with pipefail the last
+// stage that failed.
+int PipelineStatus(struct CommandSet *allCmd)
+{
+	int status = allCmd->commands[allCmd->num_cmd - 1].exit_status;
+	if (!pipefail) return status;
+	for (int j = allCmd->num_cmd - 1; j >= 0 && status == 0; j--) status = allCmd->commands[j].exit_status;
+	return status;
+}
+
+// Runs all Commands in a CommandSet, creating each stage's pipe as it is launched.
+// Every stage inherits only the two pipe FDs it needs, so the cost per stage is
+// constant and there is no limit on the number of stages.
+// Background command sets are left running for the job table to reap.
+// REF: fork-exec-wait.c, "Process pipeline example" (Syscalls p. 37)
+void RunAllCmd(struct CommandSet *allCmd, struct PipeEnv *pipeSet)
+{
+	// "cat file... > out" needs neither a process nor a pipe.
+	if (allCmd->num_cmd == 1 && !allCmd->background && IsFileCopy(&allCmd->commands[0]))
+	{
+		clock_gettime(CLOCK_MONOTONIC, &allCmd->commands[0].start_time);
+		allCmd->commands[0].exit_status = CopyToFile(&allCmd->commands[0]);
+		clock_gettime(CLOCK_MONOTONIC, &allCmd->commands[0].end_time);
+		return;
+	}
+
+	pipeSet->read_fd = -1;
+	allCmd->pgid = 0;
+
+	// Create a child for every command.
+	// Stages that could not be launched keep pid -1 and report status 1.
+	for (int cmd_order = 0; cmd_order < allCmd->num_cmd; cmd_order++)
+	{
+		struct Command *cmd = &allCmd->commands[cmd_order];
+		cmd->exit_status = 1;
+		struct timespec pipe_start = Now();
+		if (!OpenPipe(pipeSet, cmd_order == allCmd->num_cmd - 1))
+		{
+			// The rest of the line cannot be connected, so it is not launched.
+			for (int j = cmd_order + 1; j < allCmd->num_cmd; j++) allCmd->commands[j].exit_status = 1;
+			break;
+		}
+		// The last stage has no pipe of its own.
+		if (pipeSet->pipe_fds[0] != -1) TraceSpan("pipe-open", pipe_start, cmd_order);
+		clock_gettime(CLOCK_MONOTONIC, &cmd->start_time);
+		if (RunsInShell(allCmd, cmd_order))
+		{
+			// The last stage, so there is no pipe to advance.
+			cmd->exit_status = RunBuiltinStage(cmd, pipeSet);
+			clock_gettime(CLOCK_MONOTONIC, &cmd->end_time);
+			StopUpstream(allCmd, cmd_order);
+			continue;
+		}
+		// Output buffered by builtins goes out before the child's, and a forked child
+		// must not flush it a second time.
+		fflush(stdout);
+		if (launcher == LAUNCH_FORK || RelayKind(cmd) != RELAY_NONE
+			|| FindBuiltin(cmd->arguments[0]))
+			cmd->pid = ForkCommand(allCmd, pipeSet, cmd_order);
+		else
+			cmd->pid = SpawnCommand(allCmd, pipeSet, cmd_order);
+		// With posix_spawn this span also covers the child's exec.
+		TraceSpan("spawn", cmd->start_time, cmd_order);
+		if (cmd->pid > 0 && allCmd->pgid == 0) allCmd->pgid = cmd->pid;
+		AdvancePipe(pipeSet);
+	}
+	if (pipeSet->read_fd != -1) close(pipeSet->read_fd);
+	pipeSet->read_fd = -1;
+
+	if (!allCmd->background) WaitCommands(allCmd);
+}
+
+// Set from SSHELL_STATS at startup. When on, every command line is timed.
+int stats_mode = 0;
+
+// Reads SSHELL_STATS, where 1 prints resource usage with every completion message.
+void InitStats(void)
+{
+	char *mode = getenv("SSHELL_STATS");
+	if (mode && !strcmp(mode, "1")) stats_mode = 1;
+}
+
+// Seconds between two CLOCK_MONOTONIC readings.
+double Seconds(struct timespec start, struct timespec end)
+{
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+// Seconds in a rusage CPU time.
+double CpuSeconds(struct timeval time)
+{
+	return time.tv_sec + time.tv_usec / 1e6;
+}
+
+// Prints the completion message of a command line and its stages' exit statuses.
+// Timed command lines add a line per stage with its wall clock time, CPU time,
+// peak resident memory and voluntary/involuntary context switches.
+void PrintCompleted(const char *cmd, int cmd_len, struct CommandSet *allCmd)
+{
+	// The command's own output comes first.
+	fflush(stdout);
+	fprintf(stderr, "+ completed '%.*s' ", cmd_len, cmd);
+	for (int i = 0; i < allCmd->num_cmd; i++) fprintf(stderr, "[%d]", 
+		allCmd->commands[i].exit_status);
+	fprintf(stderr, "\n");
+	if (!allCmd->timed) return;
+
+	for (int i = 0; i < allCmd->num_cmd; i++)
+	{
+		struct Command *stage = &allCmd->commands[i];
+		struct rusage *usage = &stage->usage;
+		fprintf(stderr, "+   [%d] %s: real %.3fs user %.3fs sys %.3fs maxrss %ldKB ctxsw %ld/%ld\n",
+			i, stage->arguments[0], Seconds(stage->start_time, stage->end_time),
+			CpuSeconds(usage->ru_utime), CpuSeconds(usage->ru_stime),
+			usage->ru_maxrss, usage->ru_nvcsw, usage->ru_nivcsw);
+	}
+}
+
+// JOBS
+// Background command lines are kept in a job table until all their stages are reaped.
+// A job takes over the arena its CommandSet was built in, so every Command keeps its
+// pid and receives its exit_status when the job completes. SIGCHLD is blocked and read
+// from a signalfd, and reaping uses wait4(WNOHANG) on the job's own pids so it never
+// steals a foreground child.
+struct Job
+{
+	struct Job *next;
+	int id;
+	struct CommandSet commands;
+	// Copy of the command line, in the job's arena.
+	char *cmd;
+	int cmd_len;
+	// Stages not reaped yet.
+	int remaining;
+	int stopped;
+};
+
+// Job table, in order of job id.
+struct Job *jobs = NULL;
+int sigchld_fd = -1;
+int print_trailer = 1;
+// Does the shell own a terminal it can hand to a job with fg?
+int interactive_shell = 0;
+
+// Blocks SIGCHLD and SIGTTOU and opens the signalfd children are reaped through.
+// REF: signalfd(2)
+void InitJobControl(int interactive)
+{
+	sigemptyset(&child_sigmask);
+	sigemptyset(&shell_sigmask);
+	sigaddset(&shell_sigmask, SIGCHLD);
+	sigaddset(&shell_sigmask, SIGTTOU);
+	sigprocmask(SIG_BLOCK, &shell_sigmask, NULL);
+	sigchld_fd = signalfd(-1, &shell_sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+	interactive_shell = interactive && isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp();
+}
+
+// Moves a launched background CommandSet into the job table.
+// The CommandSet is left with an empty arena for the next command line.
+void AddJob(struct CommandSet *allCmd, const char *cmd, int cmd_len)
+{
+	struct Job *job = malloc(sizeof(struct Job));
+	struct Job **link = &jobs;
+	job->id = 1;
+	while (*link)
+	{
+		job->id = (*link)->id + 1;
+		link = &(*link)->next;
+	}
+	job->next = NULL;
+	*link = job;
+
+	job->cmd = ArenaAlloc(&allCmd->arena, cmd_len);
+	memcpy(job->cmd, cmd, cmd_len);
+	job->cmd_len = cmd_len;
+	job->commands = *allCmd;
+	job->remaining = 0;
+	job->stopped = 0;
+	for (int i = 0; i < allCmd->num_cmd; i++)
+		if (allCmd->commands[i].pid > 0) job->remaining++;
+	allCmd->arena = (struct Arena) { NULL, NULL, NULL };
+}
+
+// Records a state change of one of the job's stages reported by wait4.
+void UpdateJob(struct Job *job, struct Command *cmd, int status, struct rusage *usage)
+{
+	if (WIFSTOPPED(status))
+	{
+		job->stopped = 1;
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &cmd->end_time);
+	cmd->usage = *usage;
+	cmd->exit_status = StageStatus(status);
+	TraceEvent("reap", 'X', cmd->start_time, cmd->end_time, cmd->pid, cmd - job->commands.commands,
+		cmd->exit_status);
+	cmd->pid = -1;
+	job->remaining--;
+}
+
+// Reaps every job stage that changed state, without blocking.
+void ReapJobs(void)
+{
+	struct signalfd_siginfo info;
+	// Drain the notifications, the wait4 calls below find what changed.
+	while (read(sigchld_fd, &info, sizeof(info)) > 0)
+		;
+
+	for (struct Job *job = jobs; job; job = job->next)
+	{
+		for (int i = 0; i < job->commands.num_cmd; i++)
+		{
+			struct Command *cmd = &job->commands.commands[i];
+			struct rusage usage;
+			int status;
+			if (cmd->pid <= 0) continue;
+			if (wait4(cmd->pid, &status, WNOHANG | WUNTRACED, &usage) > 0) UpdateJob(job, cmd, status, &usage);
+		}
+	}
+}
+
+// Unlinks a finished job, prints its completion message and frees it.
+void FinishJob(struct Job *job)
+{
+	struct Job **link = &jobs;
+	while (*link != job) link = &(*link)->next;
+	*link = job->next;
+
+	if (print_trailer) PrintCompleted(job->cmd, job->cmd_len, &job->commands);
+	ArenaFree(&job->commands.arena);
+	free(job);
+}
+
+// Reports and removes every job whose stages have all been reaped.
+void FinishJobs(void)
+{
+	struct Job *job = jobs;
+	while (job)
+	{
+		struct Job *next = job->next;
+		if (job->remaining == 0) FinishJob(job);
+		job = next;
+	}
+}
+
+// Blocks until fd has input, reaping background jobs whenever a child changes state.
+void WaitReadable(int fd)
+{
+	struct pollfd fds[2] = { { fd, POLLIN, 0 }, { sigchld_fd, POLLIN, 0 } };
+	while (jobs)
+	{
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno == EINTR) continue;
+			return;
+		}
+		if (fds[1].revents) ReapJobs();
+		if (fds[0].revents) return;
+	}
+}
+
+// Waits for every remaining stage of a job, or until one of them stops.
+// Returns the exit status of the job's last stage.
+int WaitJob(struct Job *job)
+{
+	for (int i = 0; i < job->commands.num_cmd && !job->stopped; i++)
+	{
+		struct Command *cmd = &job->commands.commands[i];
+		struct rusage usage;
+		int status;
+		if (cmd->pid <= 0) continue;
+		if (wait4(cmd->pid, &status, WUNTRACED, &usage) > 0) UpdateJob(job, cmd, status, &usage);
+	}
+	return job->commands.commands[job->commands.num_cmd - 1].exit_status;
+}
+
+// Lets every job run to completion, resuming stopped ones, and reports them.
+// Used when a script ends, by input running out or by exit.
+void WaitAllJobs(void)
+{
+	for (struct Job *job = jobs; job; job = job->next)
+	{
+		if (job->stopped) kill(-job->commands.pgid, SIGCONT);
+		job->stopped = 0;
+		WaitJob(job);
+	}
+	FinishJobs();
+}
+
+// Finds a job from a "%n" or "n" argument, or the most recent job when there is none.
+struct Job *FindJob(struct Command *cmd)
+{
+	struct Job *job = jobs;
+	if (cmd->num_args < 2)
+	{
+		while (job && job->next) job = job->next;
+	}
+	else
+	{
+		char *id = cmd->arguments[1];
+		if (id[0] == '%') id++;
+		while (job && job->id != atoi(id)) job = job->next;
+	}
+	if (job == NULL) fprintf(stderr, "Error: no such job\n");
+	return job;
+}
+
+// jobs: lists the job table.
+int JobsBuiltin(struct Command *cmd)
+{
+	(void) cmd;
+	ReapJobs();
+	for (struct Job *job = jobs; job; job = job->next)
+	{
+		const char *state = job->remaining == 0 ? "Done" : job->stopped ? "Stopped" : "Running";
+		printf("[%d] %-8s '%.*s'\n", job->id, state, job->cmd_len, job->cmd);
+	}
+	return 0;
+}
+
+// fg [%n]: continues a job in the foreground, handing it the terminal, and waits for it.
+// REF: "Foreground and Background", GNU C Library manual, Implementing a Job Control Shell.
+int FgBuiltin(struct Command *cmd)
+{
+	struct Job *job = FindJob(cmd);
+	if (job == NULL) return 1;
+
+	fflush(stdout);
+	if (interactive_shell) tcsetpgrp(STDIN_FILENO, job->commands.pgid);
+	job->stopped = 0;
+	kill(-job->commands.pgid, SIGCONT);
+	int status = WaitJob(job);
+	if (interactive_shell) tcsetpgrp(STDIN_FILENO, getpgrp());
+
+	if (job->stopped)
+	{
+		fprintf(stderr, "[%d] Stopped '%.*s'\n", job->id, job->cmd_len, job->cmd);
+		return 1;
+	}
+	FinishJob(job);
+	return status;
+}
+
+// bg [%n]: continues a stopped job in the background.
+int BgBuiltin(struct Command *cmd)
+{
+	struct Job *job = FindJob(cmd);
+	if (job == NULL) return 1;
+	job->stopped = 0;
+	kill(-job->commands.pgid, SIGCONT);
+	return 0;
+}
+
+// wait [%n]: waits for one job, or every job, to complete.
+int WaitBuiltin(struct Command *cmd)
+{
+	int status = 0;
+	if (cmd->num_args > 1)
+	{
+		struct Job *job = FindJob(cmd);
+		if (job == NULL) return 1;
+		status = WaitJob(job);
+		if (job->remaining == 0) FinishJob(job);
+		return status;
+	}
+	for (struct Job *job = jobs; job; job = job->next)
+		if (!job->stopped) status = WaitJob(job);
+	FinishJobs();
+	return status;
+}
+
+// PARSING
+// ParseModes determine behavior of parser when encountering certain symbols.
+enum ParseModes {
+	// Building the argument of a command.
+	SEARCH_COMMAND,
+	// Building an output filename.
+	SEARCH_FILENAME
+};
+
+enum ParsingErrors
+{
+	MISSING_TOKEN, // Missing output file or command
+	BAD_FILE, // Can't open file
+	MISLOCATED_REDIRECT, // Mislocated output
+	MISLOCATED_BACKGROUND // "&" that is not at the end of the line
+};
+
+// Parsing error reporting system.
+// REF: "project1.pdf" slide 34.
+void ParsingError(int error_code, int read_mode) 
+{
+	// Output of earlier builtins comes first.
+	fflush(stdout);
+	switch(error_code)
+	{
+		case MISSING_TOKEN:
+			if (read_mode == SEARCH_COMMAND) fprintf(stderr, "Error: missing command\n");
+			if (read_mode == SEARCH_FILENAME) fprintf(stderr, "Error: no output file\n");
+			break;
+		case BAD_FILE:
+			fprintf(stderr, "Error: cannot open output file\n");
+			break;
+		case MISLOCATED_REDIRECT:
+			fprintf(stderr, "Error: mislocated output redirection\n");
+			break;
+		case MISLOCATED_BACKGROUND:
+			fprintf(stderr, "Error: mislocated background sign\n");
+			break;
+		default:
+			break;
+	}
+}
+
+// Checks that a particular file can be opened.
+int VerifyFile(char *filename)
+{
+	int open_file = 0;
+	open_file = open(filename, O_WRONLY | O_CREAT, 0644);
+	if (open_file == -1)
+	{
+		ParsingError(BAD_FILE, 0);
+		return 0;
+	}
+	close(open_file);
+	return 1;
+}
+
+// Appends an argument to a Command, growing its argument array in the arena.
+void AddArgument(struct Arena *arena, struct Command *cmd, char *argument)
+{
+	// Keep room for the terminating NULL.
+	if (cmd->num_args + 1 >= cmd->max_args)
+	{
+		int max_args = cmd->max_args ? cmd->max_args * 2 : 8;
+		cmd->arguments = ArenaGrow(arena, cmd->arguments,
+			sizeof(char *) * cmd->max_args, sizeof(char *) * max_args);
+		cmd->max_args = max_args;
+	}
+	cmd->arguments[cmd->num_args++] = argument;
+	cmd->arguments[cmd->num_args] = NULL;
+}
+
+// Hands the token spanning line[start, start + length) to the argument list or output
+// file of the current Command, depending on the read mode.
+// The token is NUL terminated in place, so the Command points straight into the line.
+int CopyToken(struct CommandSet *allCmd, char *line, int start, int *length, int read_mode)
+{
+	struct Command *cmd = &allCmd->commands[allCmd->num_cmd];
+
+	// If no token was read, raise a missing command/file error.
+	if (*length == 0)
+	{
+		ParsingError(MISSING_TOKEN, read_mode);
+		return 0;
+	}
+	// The character after the token is whitespace or a meta-character already read.
+	char *token = line + start;
+	token[*length] = '\0';
+
+	// If token is a file name, verify that the file can be opened.
+	if (read_mode == SEARCH_FILENAME)
+		if (!VerifyFile(token)) return 0;
+
+	// Hand over the token then flush it.
+	if (read_mode == SEARCH_COMMAND)
+		AddArgument(&allCmd->arena, cmd, token);
+	else
+		cmd->output_name = token;
+	*length = 0;
+	return 1;
+}
+
+// Initialize Command Object values.
+void InitCommand(struct Command *cmd)
+{
+	cmd->output_dest = STDOUT_FILENO;
+	cmd->output_name = " ";
+	cmd->output_to_file = 0;
+	cmd->err_to_pipe = 0;
+	cmd->err_to_file = 0;
+	cmd->arguments = NULL;
+	cmd->num_args = 0;
+	cmd->max_args = 0;
+	cmd->pid = -1;
+	cmd->exit_status = 0;
+	cmd->start_time = (struct timespec) { 0, 0 };
+	cmd->end_time = (struct timespec) { 0, 0 };
+	memset(&cmd->usage, 0, sizeof(cmd->usage));
+}
+
+// Starts the next Command of the set, growing the command array in the arena.
+void NewCommand(struct CommandSet *allCmd)
+{
+	if (allCmd->num_cmd >= allCmd->max_cmd)
+	{
+		int max_cmd = allCmd->max_cmd ? allCmd->max_cmd * 2 : 4;
+		allCmd->commands = ArenaGrow(&allCmd->arena, allCmd->commands,
+			sizeof(struct Command) * allCmd->max_cmd, sizeof(struct Command) * max_cmd);
+		allCmd->max_cmd = max_cmd;
+	}
+	InitCommand(&allCmd->commands[allCmd->num_cmd]);
+}
+
+// Returns the index of the first whitespace or meta-character at or after i.
+int ScanTokenScalar(const char *line, int i, int line_len)
+{
+	while (i < line_len && line[i] != ' ' && line[i] != '|' && line[i] != '>' && line[i] != '&') i++;
+	return i;
+}
+
+#if defined(__x86_64__)
+// Same as ScanTokenScalar, comparing 16 characters at a time against every delimiter.
+// REF: Intel Intrinsics Guide, _mm_cmpeq_epi8 and _mm_movemask_epi8.
+__attribute__((target("sse2")))
+int ScanTokenSSE2(const char *line, int i, int line_len)
+{
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i pipe = _mm_set1_epi8('|');
+	const __m128i redirect = _mm_set1_epi8('>');
+	const __m128i background = _mm_set1_epi8('&');
+	while (i + 16 <= line_len)
+	{
+		__m128i chunk = _mm_loadu_si128((const __m128i *) (line + i));
+		__m128i hits = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(chunk, space), _mm_cmpeq_epi8(chunk, background)),
+			_mm_or_si128(_mm_cmpeq_epi8(chunk, pipe), _mm_cmpeq_epi8(chunk, redirect)));
+		int mask = _mm_movemask_epi8(hits);
+		if (mask) return i + __builtin_ctz(mask);
+		i += 16;
+	}
+	return ScanTokenScalar(line, i, line_len);
+}
+
+// AVX2 version of ScanTokenSSE2, 32 characters at a time.
+__attribute__((target("avx2")))
+int ScanTokenAVX2(const char *line, int i, int line_len)
+{
+	const __m256i space = _mm256_set1_epi8(' ');
+	const __m256i pipe = _mm256_set1_epi8('|');
+	const __m256i redirect = _mm256_set1_epi8('>');
+	const __m256i background = _mm256_set1_epi8('&');
+	while (i + 32 <= line_len)
+	{
+		__m256i chunk = _mm256_loadu_si256((const __m256i *) (line + i));
+		__m256i hits = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(chunk, space), _mm256_cmpeq_epi8(chunk, background)),
+			_mm256_or_si256(_mm256_cmpeq_epi8(chunk, pipe), _mm256_cmpeq_epi8(chunk, redirect)));
+		unsigned int mask = _mm256_movemask_epi8(hits);
+		if (mask) return i + __builtin_ctz(mask);
+		i += 32;
+	}
+	return ScanTokenSSE2(line, i, line_len);
+}
+#endif
+
+// Token scanner used by ParseCmd, picked by InitScanner.
+int (*ScanToken)(const char *line, int i, int line_len) = ScanTokenScalar;
+
+// Picks the widest token scanner the CPU supports.
+void InitScanner(void)
+{
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		ScanToken = ScanTokenAVX2;
+	else if (__builtin_cpu_supports("sse2"))
+		ScanToken = ScanTokenSSE2;
+#endif
+}
+
+// Runs through the command line in a single pass, splitting it into Command Objects.
+// Works by recording the span of a token then handing it to a piece of a Command Object.
+// Meta-characters are handled one at a time while ordinary characters are skipped a
+// whole token at a time, so every character is looked at once and parsing is O(n).
+// Everything is allocated from the CommandSet's arena, so there is no limit on
+// arguments, token length or pipeline stages.
+// cmd does not need to be NUL terminated.
+int ParseCmd(struct CommandSet *allCmd, const char *cmd, int cmd_len)
+{
+	// Tokens are terminated in place, so parse a copy and keep cmd intact for the
+	// completion message.
+	char *line = ArenaAlloc(&allCmd->arena, cmd_len + 1);
+	memcpy(line, cmd, cmd_len);
+	line[cmd_len] = '\0';
+
+	// Span of the token being read.
+	int token_start = 0;
+	int length = 0;
+
+	// "Reading mode" to determine where fully read tokens go.
+	int read_mode = SEARCH_COMMAND;
+
+	// If the parser runs through whitespace while looking for a command.
+	int encounter_whitespace = 0;
+	int init_skip = 1;
+
+	// Initialize Command Set variables.
+	// Initial target is the first argument of the first Command.
+	allCmd->commands = NULL;
+	allCmd->max_cmd = 0;
+	allCmd->num_cmd = 0;
+	allCmd->background = 0;
+	NewCommand(allCmd);
+
+	int i = 0;
+	while (i < cmd_len)
+	{
+		char read_char = line[i];
+		switch(read_char)
+		{
+			case '|':
+				// Attempt to copy token to target location.
+				if (!CopyToken(allCmd, line, token_start, &length, read_mode)) return 1;
+
+				// If current command has a file output and now trying to pipe, raise mislocation error.
+				if (allCmd->commands[allCmd->num_cmd].output_to_file)
 				{
-					ParsingError(ARG_OVERFLOW, 0);
+					ParsingError(MISLOCATED_REDIRECT, 0);
 					return 1;
 				}
 
-				// If current command has a file output and now trying to pipe, raise mislocation error.
-				if (allCmd->commands[allCmd->num_cmd].output_to_file)
-				{
-					ParsingError(MISLOCATED_REDIRECT, 0);
-					return 1;
-				}
+				// If the symbol was actually "|&" indicate that stderr needs to be piped.
+				i++;
+				if (i < cmd_len && line[i] == '&')
+				{
+					allCmd->commands[allCmd->num_cmd].err_to_pipe = 1;
+					i++;
+				}
+
+				// Define and set up new target. 
+				// First argument of the next Command object in the CommandSet.
+				allCmd->num_cmd++;
+				NewCommand(allCmd);
+
+				// Start looking for the first argument of a new Command.
+				encounter_whitespace = 0;
+				init_skip = 1;
+				read_mode = SEARCH_COMMAND;
+				break;
+			case '>':
+				// Attempt to copy token to target location.
+				if (!CopyToken(allCmd, line, token_start, &length, read_mode)) return 1;
+
+				// Set new target as the output filename of current Command.
+				allCmd->commands[allCmd->num_cmd].output_to_file = 1;
+
+				// If the symbol is actually ">&", indicate to output stderr to a file.
+				i++;
+				if (i < cmd_len && line[i] == '&')
+				{
+					allCmd->commands[allCmd->num_cmd].err_to_file = 1;
+					i++;
+				}
+
+				// Start looking for a file name.
+				encounter_whitespace = 0;
+				read_mode = SEARCH_FILENAME;
+				break;
+			case '&':
+				// Attempt to copy token to target location.
+				if (!CopyToken(allCmd, line, token_start, &length, read_mode)) return 1;
+
+				// Only whitespace may follow the background sign.
+				for (i++; i < cmd_len; i++)
+				{
+					if (line[i] != ' ')
+					{
+						ParsingError(MISLOCATED_BACKGROUND, 0);
+						return 1;
+					}
+				}
+				allCmd->background = 1;
+				allCmd->num_cmd++;
+				return 0;
+			case ' ':
+				if (read_mode == SEARCH_COMMAND) encounter_whitespace = 1; 
+				// Only count whitespace for filename search if build process has started.
+				if (read_mode == SEARCH_FILENAME && length > 0) {
+					encounter_whitespace = 1;
+				}
+				i++;
+				break;
+			default:
+				// Encountered the first character of a new token (token___token).
+				// init_skip prevents command argument copies for cases like ____(token).
+				if (encounter_whitespace && !init_skip)
+				{
+					// Attempt to copy token to target location.
+					if (!CopyToken(allCmd, line, token_start, &length, read_mode)) return 1;
+					// Next target is the next argument of the Command.
+					read_mode = SEARCH_COMMAND;
+				}
+				init_skip = 0;
+				encounter_whitespace = 0;
+				// The whole run of ordinary characters is the new token.
+				token_start = i;
+				i = ScanToken(line, i, cmd_len);
+				length = i - token_start;
+				break;
+		}			
+	}
+
+	// End of parsing, handle any hanging text.
+	// The command has a hanging meta-character, or the user entered nothing.
+	if (length == 0) {
+		if (allCmd->commands[0].num_args > 0) ParsingError(MISSING_TOKEN, read_mode);
+		return 1;
+	}
+
+	// Otherwise, copy the hanging text to the target and update final parameters.
+	if (!CopyToken(allCmd, line, token_start, &length, read_mode)) return 1;
+	allCmd->num_cmd++;
+	return 0;
+}
+
+// LINE READER
+// Hands out complete command lines of any length, replacing fgets.
+// Input from a file descriptor is read() in large blocks into a buffer that is
+// compacted and grown as needed so every line is contiguous. Script files are
+// mmap'd whole and strings (-c) are used in place, so lines point straight at them.
+struct LineReader
+{
+	// Source descriptor, -1 when the whole input is already in buffer.
+	int fd;
+	char *buffer;
+	size_t capacity;
+	// Unread data is buffer[start, end).
+	size_t start;
+	size_t end;
+	int eof;
+};
+
+// Reads from a file descriptor such as stdin.
+void InitFdReader(struct LineReader *reader, int fd)
+{
+	reader->fd = fd;
+	reader->capacity = READER_BLOCK_SIZE;
+	reader->buffer = malloc(reader->capacity);
+	reader->start = reader->end = 0;
+	reader->eof = 0;
+}
+
+// Reads from a string that is already in memory.
+void InitStringReader(struct LineReader *reader, char *string, size_t length)
+{
+	reader->fd = -1;
+	reader->buffer = string;
+	reader->capacity = length;
+	reader->start = 0;
+	reader->end = length;
+	reader->eof = 1;
+}
+
+// Reads from a script file, mapping it when it is a regular file.
+// Returns 0 if the file cannot be opened.
+int InitFileReader(struct LineReader *reader, const char *path)
+{
+	struct stat file_info;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) return 0;
+
+	if (!fstat(fd, &file_info) && S_ISREG(file_info.st_mode) && file_info.st_size > 0)
+	{
+		void *map = mmap(NULL, file_info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED)
+		{
+			madvise(map, file_info.st_size, MADV_SEQUENTIAL);
+			close(fd);
+			// The mapping lasts as long as the shell: the last line is still
+			// printed by the exit message after input ends.
+			InitStringReader(reader, map, file_info.st_size);
+			return 1;
+		}
+	}
+	// Pipes, empty files and anything mmap refuses are read in blocks.
+	InitFdReader(reader, fd);
+	return 1;
+}
+
+// Returns the next line without its newline and stores its length, or NULL at end of input.
+// The line is not NUL terminated and stays valid until the next call.
+char *ReadLine(struct LineReader *reader, int *length)
+{
+	size_t scanned = reader->start;
+	while (1)
+	{
+		char *newline = memchr(reader->buffer + scanned, '\n', reader->end - scanned);
+		if (newline)
+		{
+			char *line = reader->buffer + reader->start;
+			*length = newline - line;
+			reader->start = newline - reader->buffer + 1;
+			return line;
+		}
+		scanned = reader->end;
+
+		if (reader->eof)
+		{
+			// Hand out a last line that has no newline.
+			if (reader->start == reader->end) return NULL;
+			char *line = reader->buffer + reader->start;
+			*length = reader->end - reader->start;
+			reader->start = reader->end;
+			return line;
+		}
+
+		// Move the partial line to the front, growing the buffer if it fills it.
+		if (reader->start > 0)
+		{
+			memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+			reader->end -= reader->start;
+			scanned -= reader->start;
+			reader->start = 0;
+		}
+		if (reader->end == reader->capacity)
+		{
+			reader->capacity *= 2;
+			reader->buffer = realloc(reader->buffer, reader->capacity);
+		}
+
+		// Keep reaping background jobs while waiting for input.
+		WaitReadable(reader->fd);
+		ssize_t bytes = read(reader->fd, reader->buffer + reader->end, reader->capacity - reader->end);
+		if (bytes < 0 && errno == EINTR) continue;
+		if (bytes <= 0) reader->eof = 1;
+		else reader->end += bytes;
+	}
+}
+
+// MISC BUILTIN
+// Special ls that prints all filenames and byte size of current directory.
+// Entries are read straight from getdents64 in 1 MB batches and sized with statx
+// relative to the directory FD, asking only for STATX_SIZE so no path is walked twice
+// and filesystems can skip the rest of the inode. Large directories are sized by
+// several threads at once, since on network and overlay filesystems each lookup is
+// mostly waiting. Lines are built in one buffer, in directory order, that goes out
+// with a single write instead of a printf per file.
+// REF: dir_scan.c, stat.c, "Syscalls" slides 32-33, getdents64(2), statx(2).
+#define SLS_DENTS_SIZE (1024 * 1024)
+
+// A buffer of output lines that grows as needed.
+struct OutputBuffer
+{
+	char *data;
+	size_t length;
+	size_t capacity;
+};
+
+// Makes room for at least size more bytes.
+void ReserveOutput(struct OutputBuffer *out, size_t size)
+{
+	if (out->length + size <= out->capacity) return;
+	while (out->length + size > out->capacity)
+		out->capacity = out->capacity ? out->capacity * 2 : SLS_DENTS_SIZE;
+	out->data = realloc(out->data, out->capacity);
+}
+
+// Appends "name (size bytes)\n".
+void AppendSizeLine(struct OutputBuffer *out, const char *name, unsigned long long size)
+{
+	size_t name_len = strlen(name);
+	char digits[24];
+	int num_digits = 0;
+	do
+	{
+		digits[num_digits++] = '0' + size % 10;
+		size /= 10;
+	} while (size > 0);
+
+	ReserveOutput(out, name_len + num_digits + sizeof(" ( bytes)\n"));
+	char *line = out->data + out->length;
+	memcpy(line, name, name_len);
+	line += name_len;
+	*line++ = ' ';
+	*line++ = '(';
+	while (num_digits > 0) *line++ = digits[--num_digits];
+	memcpy(line, " bytes)\n", 8);
+	line += 8;
+	out->length = line - out->data;
+}
+
+// Size of a directory entry, following symlinks like stat does. A dangling symlink
+// reports the size of the link itself. Falls back to fstatat on kernels without statx.
+// Returns -1 on failure.
+long long EntrySize(int dir_fd, const char *name)
+{
+	static int use_statx = 1;
+	int flags = 0;
+	while (1)
+	{
+		if (use_statx)
+		{
+			struct statx file_info;
+			if (!statx(dir_fd, name, flags | AT_STATX_DONT_SYNC, STATX_SIZE, &file_info))
+				return file_info.stx_size;
+			if (errno == ENOSYS)
+			{
+				use_statx = 0;
+				continue;
+			}
+		}
+		else
+		{
+			struct stat file_info;
+			if (!fstatat(dir_fd, name, &file_info, flags)) return file_info.st_size;
+		}
+		if (errno != ENOENT || flags) return -1;
+		flags = AT_SYMLINK_NOFOLLOW;
+	}
+}
+
+// One line of a listing, kept compact so sorting a million of them moves little
+// memory: where its name sits in the name pool and its size in bytes, -1 until it
+// is known or if the file cannot be found.
+struct SlsRecord
+{
+	size_t name;
+	long long size;
+};
+
+// Directories with at least this many entries are sized by a pool of threads.
+#define SLS_PARALLEL_MIN 256
+// Entries a worker claims at a time.
+#define SLS_BATCH 64
+
+// Set from SSHELL_SLS_THREADS at startup: how many threads size entries at once.
+// Lookups mostly wait on the filesystem, so this may exceed the number of CPUs.
+int sls_threads = 8;
+
+// Reads SSHELL_SLS_THREADS, where 1 sizes every entry on the shell's own thread.
+void InitSlsThreads(void)
+{
+	char *threads = getenv("SSHELL_SLS_THREADS");
+	if (threads && atoi(threads) > 0) sls_threads = atoi(threads) > 64 ? 64 : atoi(threads);
+}
+
+// Work shared by the threads sizing one listing.
+struct SlsJob
+{
+	int dir_fd;
+	const char *names;
+	struct SlsRecord *entries;
+	size_t num_entries;
+	// Next entry nobody has claimed yet.
+	size_t next;
+};
+
+// Claims batches of entries until none are left, sizing each one in place.
+// Every entry has exactly one writer, so the output order stays the directory order.
+void *SizeEntries(void *arg)
+{
+	struct SlsJob *job = arg;
+	while (1)
+	{
+		size_t first = __atomic_fetch_add(&job->next, SLS_BATCH, __ATOMIC_RELAXED);
+		if (first >= job->num_entries) return NULL;
+		size_t last = first + SLS_BATCH < job->num_entries ? first + SLS_BATCH : job->num_entries;
+		for (size_t i = first; i < last; i++)
+			job->entries[i].size = EntrySize(job->dir_fd, job->names + job->entries[i].name);
+	}
+}
+
+// Options of one sls invocation: sls [-R] [-a] [-N] [-S] [-m SIZE] [-g GLOB] [-n N] [dir]
+struct SlsOptions
+{
+	// -R: list the total bytes under every directory of the tree instead of files.
+	int recursive;
+	// -a: include hidden files and directories.
+	int all;
+	// -N: by name.
+	int by_name;
+	// -S: largest first, ties in name order with -N.
+	int by_size;
+	// -m SIZE: leave out anything smaller.
+	long long min_size;
+	// -g GLOB: only names that match, the last component of paths with -R.
+	const char *glob;
+	// -n N: print only the first N lines, -1 for all of them.
+	long limit;
+	const char *dir;
+};
+
+// Is the entry listed? ".." and "." never are, other hidden names only with -a.
+int ShowEntry(const char *name, int all)
+{
+	if (name[0] != '.') return 1;
+	if (!all) return 0;
+	return name[1] != '\0' && (name[1] != '.' || name[2] != '\0');
+}
+
+// Runs this short are insertion sorted before merging.
+#define SLS_MERGE_RUN 16
+
+// Sorts records by name, keeping equal names in order.
+// A bottom-up merge sort: insertion sorted runs, then merges that double in width,
+// alternating between the records and one scratch array.
+void SortRecordsByName(const char *names, struct SlsRecord *records, size_t num_records)
+{
+	for (size_t start = 0; start < num_records; start += SLS_MERGE_RUN)
+	{
+		size_t end = start + SLS_MERGE_RUN < num_records ? start + SLS_MERGE_RUN : num_records;
+		for (size_t i = start + 1; i < end; i++)
+		{
+			struct SlsRecord record = records[i];
+			size_t j = i;
+			for (; j > start && strcmp(names + records[j - 1].name, names + record.name) > 0; j--)
+				records[j] = records[j - 1];
+			records[j] = record;
+		}
+	}
+	if (num_records <= SLS_MERGE_RUN) return;
+
+	struct SlsRecord *from = records;
+	struct SlsRecord *to = malloc(num_records * sizeof(struct SlsRecord));
+	for (size_t width = SLS_MERGE_RUN; width < num_records; width *= 2)
+	{
+		for (size_t left = 0; left < num_records; left += 2 * width)
+		{
+			size_t middle = left + width < num_records ? left + width : num_records;
+			size_t right = left + 2 * width < num_records ? left + 2 * width : num_records;
+			size_t i = left, j = middle, k = left;
+			while (i < middle && j < right)
+				to[k++] = strcmp(names + from[j].name, names + from[i].name) < 0 ? from[j++] : from[i++];
+			while (i < middle) to[k++] = from[i++];
+			while (j < right) to[k++] = from[j++];
+		}
+		struct SlsRecord *swap = from;
+		from = to;
+		to = swap;
+	}
+	if (from != records)
+	{
+		memcpy(records, from, num_records * sizeof(struct SlsRecord));
+		to = from;
+	}
+	free(to);
+}
+
+// Sorts records largest first, keeping equal sizes in order.
+// An LSD radix sort on the complemented size a byte at a time, skipping passes where
+// every record has the same byte, so small sizes only cost a few linear passes.
+void SortRecordsBySize(struct SlsRecord *records, size_t num_records)
+{
+	struct SlsRecord *from = records;
+	struct SlsRecord *to = malloc(num_records * sizeof(struct SlsRecord));
+	for (int shift = 0; shift < 64; shift += 8)
+	{
+		size_t offsets[256] = { 0 };
+		for (size_t i = 0; i < num_records; i++)
+			offsets[(~(unsigned long long) from[i].size >> shift) & 0xff]++;
+		if (offsets[(~(unsigned long long) from[0].size >> shift) & 0xff] == num_records) continue;
+
+		size_t total = 0;
+		for (int digit = 0; digit < 256; digit++)
+		{
+			size_t count = offsets[digit];
+			offsets[digit] = total;
+			total += count;
+		}
+		for (size_t i = 0; i < num_records; i++)
+			to[offsets[(~(unsigned long long) from[i].size >> shift) & 0xff]++] = from[i];
+		struct SlsRecord *swap = from;
+		from = to;
+		to = swap;
+	}
+	if (from != records)
+	{
+		memcpy(records, from, num_records * sizeof(struct SlsRecord));
+		to = from;
+	}
+	free(to);
+}
+
+// Is the record kept by the -m and -g filters?
+int KeepRecord(const char *name, struct SlsRecord *record, struct SlsOptions *options)
+{
+	if (record->size < options->min_size) return 0;
+	if (options->glob == NULL) return 1;
+	const char *base = strrchr(name, '/');
+	return !fnmatch(options->glob, base && base[1] ? base + 1 : name, 0);
+}
+
+// Filters and sorts the records as asked, then writes the first -n of them with a
+// single write. Records of -R are always sorted by path, as the walk finds them in
+// no particular order. Returns 1 if the output could not be written.
+int PrintRecords(const char *names, struct SlsRecord *records, size_t num_records,
+	struct SlsOptions *options)
+{
+	size_t kept = 0;
+	for (size_t i = 0; i < num_records; i++)
+		if (KeepRecord(names + records[i].name, &records[i], options)) records[kept++] = records[i];
+	num_records = kept;
+
+	if (options->by_name || options->recursive) SortRecordsByName(names, records, num_records);
+	if (options->by_size && num_records > 0) SortRecordsBySize(records, num_records);
+	if (options->limit >= 0 && (size_t) options->limit < num_records) num_records = options->limit;
+
+	struct OutputBuffer out = { NULL, 0, 0 };
+	for (size_t i = 0; i < num_records; i++)
+		AppendSizeLine(&out, names + records[i].name, records[i].size);
+
+	// Keep the order with anything already printed through stdio.
+	int status = 0;
+	fflush(stdout);
+	if (out.length > 0 && WriteAll(STDOUT_FILENO, out.data, out.length)) status = 1;
+	free(out.data);
+	return status;
+}
+
+// Lists the files of one directory with their sizes, in directory order unless sorted.
+int ListDirectory(struct SlsOptions *options)
+{
+	// Open the directory.
+	int dir_fd = open(options->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	// Account for directories that lack permissions.
+	if (dir_fd == -1)
+	{
+		fprintf(stderr, "Error: cannot open directory\n");
+		return 1;
+	}
+
+	// First collect every name, so the lookups can be spread over threads.
+	char *dents = malloc(SLS_DENTS_SIZE);
+	struct OutputBuffer names = { NULL, 0, 0 };
+	struct SlsRecord *entries = NULL;
+	size_t num_entries = 0;
+	size_t max_entries = 0;
+	ssize_t bytes;
+	while ((bytes = getdents64(dir_fd, dents, SLS_DENTS_SIZE)) > 0)
+	{
+		for (ssize_t offset = 0; offset < bytes; )
+		{
+			struct dirent64 *entry = (struct dirent64 *) (dents + offset);
+			offset += entry->d_reclen;
+			// Skip ".", "..", and hidden files and folders unless asked for.
+			if (!ShowEntry(entry->d_name, options->all)) continue;
+			if (num_entries == max_entries)
+			{
+				max_entries = max_entries ? max_entries * 2 : 1024;
+				entries = realloc(entries, max_entries * sizeof(struct SlsRecord));
+			}
+			size_t name_len = strlen(entry->d_name) + 1;
+			ReserveOutput(&names, name_len);
+			memcpy(names.data + names.length, entry->d_name, name_len);
+			entries[num_entries++] = (struct SlsRecord) { names.length, -1 };
+			names.length += name_len;
+		}
+	}
+	free(dents);
+	int status = bytes < 0;
+	if (status) fprintf(stderr, "Error: cannot read directory\n");
+
+	// Size the entries, on a pool of threads for large directories.
+	struct SlsJob job = { dir_fd, names.data, entries, num_entries, 0 };
+	int num_threads = 0;
+	pthread_t threads[64];
+	if (num_entries >= SLS_PARALLEL_MIN)
+	{
+		// The shell's thread works too, so start one fewer.
+		while (num_threads < sls_threads - 1
+			&& !pthread_create(&threads[num_threads], NULL, SizeEntries, &job)) num_threads++;
+	}
+	SizeEntries(&job);
+	for (int i = 0; i < num_threads; i++) pthread_join(threads[i], NULL);
+
+	// Files removed since the directory was read are left out.
+	size_t num_records = 0;
+	for (size_t i = 0; i < num_entries; i++)
+		if (entries[i].size >= 0) entries[num_records++] = entries[i];
+	if (PrintRecords(names.data, entries, num_records, options)) status = 1;
+
+	free(names.data);
+	free(entries);
+	close(dir_fd);
+	return status;
+}
+
+// TREE WALK
+// sls -R reads a whole tree with a pool of threads, like a parallel du. Every worker
+// owns a deque of directories still to read: it pushes the subdirectories it finds
+// and pops its newest one, which keeps its walk depth-first and cache friendly, and
+// when its deque is empty it steals the oldest directory of another worker, which
+// is the root of the largest unexplored subtree. Each directory records the bytes of
+// its own files, and totals are summed bottom-up once the walk is over.
+// Directories are opened with openat relative to their parent's FD, so no path is
+// resolved twice and the depth of the tree is not limited by PATH_MAX. A parent's
+// FD stays open until the last of its subdirectories has been opened.
+// REF: Blumofe & Leiserson, "Scheduling Multithreaded Computations by Work Stealing".
+struct DirNode
+{
+	struct DirNode *parent;
+	// Path from the directory given to sls, only used for output. The last
+	// component is the name opened relative to the parent.
+	char *path;
+	// The directory's FD, and how many of its subdirectories have yet to open it,
+	// plus one while it is being read. The FD is closed when that reaches 0.
+	int fd;
+	int refs;
+	// Position in the walk's node list. A parent is always added before its children.
+	size_t seq;
+	// Bytes in the files directly inside this directory.
+	unsigned long long bytes;
+	// Set if the directory could not be read, which leaves it out of the listing.
+	int failed;
+};
+
+// Directories waiting to be read by one worker.
+struct WalkQueue
+{
+	pthread_mutex_t lock;
+	struct DirNode **items;
+	size_t head;
+	size_t tail;
+	size_t capacity;
+};
+
+struct TreeWalk
+{
+	int all;
+	int num_workers;
+	struct WalkQueue *queues;
+	// Directories in the deques, and directories queued or being read. The walk is
+	// over when pending reaches 0. Workers with nothing to do sleep on work.
+	pthread_mutex_t idle_lock;
+	pthread_cond_t work;
+	size_t queued;
+	size_t pending;
+	// Every directory found, in order of discovery.
+	pthread_mutex_t nodes_lock;
+	struct DirNode **nodes;
+	size_t num_nodes;
+	size_t max_nodes;
+	int errors;
+};
+
+struct WalkWorker
+{
+	struct TreeWalk *walk;
+	int id;
+};
+
+// Adds a directory to the walk and to the given worker's deque.
+void PushDirectory(struct TreeWalk *walk, int worker, struct DirNode *parent, char *path)
+{
+	struct DirNode *node = malloc(sizeof(struct DirNode));
+	node->parent = parent;
+	node->path = path;
+	node->fd = -1;
+	node->refs = 0;
+	node->bytes = 0;
+	node->failed = 0;
+	if (parent) __atomic_add_fetch(&parent->refs, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&walk->nodes_lock);
+	if (walk->num_nodes == walk->max_nodes)
+	{
+		walk->max_nodes = walk->max_nodes ? walk->max_nodes * 2 : 1024;
+		walk->nodes = realloc(walk->nodes, walk->max_nodes * sizeof(struct DirNode *));
+	}
+	node->seq = walk->num_nodes;
+	walk->nodes[walk->num_nodes++] = node;
+	pthread_mutex_unlock(&walk->nodes_lock);
+
+	struct WalkQueue *queue = &walk->queues[worker];
+	pthread_mutex_lock(&queue->lock);
+	if (queue->tail == queue->capacity)
+	{
+		// Reuse the space stolen from the front before growing.
+		if (queue->head > 0)
+		{
+			memmove(queue->items, queue->items + queue->head, (queue->tail - queue->head) * sizeof(node));
+			queue->tail -= queue->head;
+			queue->head = 0;
+		}
+		if (queue->tail == queue->capacity)
+		{
+			queue->capacity = queue->capacity ? queue->capacity * 2 : 64;
+			queue->items = realloc(queue->items, queue->capacity * sizeof(node));
+		}
+	}
+	queue->items[queue->tail++] = node;
+	pthread_mutex_unlock(&queue->lock);
+
+	pthread_mutex_lock(&walk->idle_lock);
+	walk->queued++;
+	walk->pending++;
+	pthread_cond_signal(&walk->work);
+	pthread_mutex_unlock(&walk->idle_lock);
+}
+
+// Drops one reference to a directory's FD, closing it with the last one.
+void ReleaseDirectory(struct DirNode *node)
+{
+	if (__atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) == 0) close(node->fd);
+}
+
+// Takes the newest directory of the worker's own deque, or steals the oldest one of
+// another worker. Returns NULL if every deque is empty.
+struct DirNode *PopDirectory(struct TreeWalk *walk, int worker)
+{
+	for (int i = 0; i < walk->num_workers; i++)
+	{
+		int victim = (worker + i) % walk->num_workers;
+		struct WalkQueue *queue = &walk->queues[victim];
+		struct DirNode *node = NULL;
+		pthread_mutex_lock(&queue->lock);
+		if (queue->head < queue->tail)
+			node = victim == worker ? queue->items[--queue->tail] : queue->items[queue->head++];
+		pthread_mutex_unlock(&queue->lock);
+		if (node) return node;
+	}
+	return NULL;
+}
+
+// Where a subdirectory's name starts in its path: after the parent's path and a
+// "/", unless the parent is the root directory "/".
+size_t NameOffset(const char *parent_path)
+{
+	size_t length = strlen(parent_path);
+	return length > 0 && parent_path[length - 1] == '/' ? length : length + 1;
+}
+
+// Reads one directory: adds up its files and queues its subdirectories.
+// Symlinks are sized but never followed, so the walk cannot loop.
+void ReadDirectory(struct TreeWalk *walk, int worker, struct DirNode *node, char *dents)
+{
+	// Subdirectories are opened by name in their parent, the root by its path.
+	struct DirNode *parent = node->parent;
+	const char *name = parent ? node->path + NameOffset(parent->path) : node->path;
+	int dir_fd = openat(parent ? parent->fd : AT_FDCWD, name,
+		O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (parent) ReleaseDirectory(parent);
+	if (dir_fd == -1)
+	{
+		fprintf(stderr, "Error: cannot open directory %s\n", node->path);
+		__atomic_store_n(&walk->errors, 1, __ATOMIC_RELAXED);
+		node->failed = 1;
+		return;
+	}
+	// Set before any subdirectory is queued, and held while the directory is read.
+	node->fd = dir_fd;
+	__atomic_add_fetch(&node->refs, 1, __ATOMIC_RELAXED);
+
+	ssize_t bytes;
+	while ((bytes = getdents64(dir_fd, dents, SLS_DENTS_SIZE)) > 0)
+	{
+		for (ssize_t offset = 0; offset < bytes; )
+		{
+			struct dirent64 *entry = (struct dirent64 *) (dents + offset);
+			offset += entry->d_reclen;
+			if (!ShowEntry(entry->d_name, walk->all)) continue;
+
+			int is_dir = entry->d_type == DT_DIR;
+			if (entry->d_type != DT_DIR)
+			{
+				// Files need their size, and some filesystems leave the type out.
+				struct statx file_info;
+				if (statx(dir_fd, entry->d_name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+					STATX_TYPE | STATX_SIZE, &file_info)) continue;
+				is_dir = S_ISDIR(file_info.stx_mode);
+				if (!is_dir) node->bytes += file_info.stx_size;
+			}
+			if (!is_dir) continue;
+
+			size_t name_offset = NameOffset(node->path);
+			size_t name_len = strlen(entry->d_name);
+			char *path = malloc(name_offset + name_len + 1);
+			memcpy(path, node->path, name_offset - 1);
+			path[name_offset - 1] = '/';
+			memcpy(path + name_offset, entry->d_name, name_len + 1);
+			PushDirectory(walk, worker, node, path);
+		}
+	}
+	if (bytes < 0)
+	{
+		fprintf(stderr, "Error: cannot read directory %s\n", node->path);
+		__atomic_store_n(&walk->errors, 1, __ATOMIC_RELAXED);
+	}
+	// Subdirectories still to be opened keep the FD alive.
+	ReleaseDirectory(node);
+}
+
+// Reads directories until the whole tree has been read.
+void *RunWalkWorker(void *arg)
+{
+	struct WalkWorker *worker = arg;
+	struct TreeWalk *walk = worker->walk;
+	char *dents = malloc(SLS_DENTS_SIZE);
+	while (1)
+	{
+		// Sleep until a directory is queued, or every directory has been read.
+		// Another worker may still be reading one that has subdirectories.
+		pthread_mutex_lock(&walk->idle_lock);
+		while (walk->queued == 0 && walk->pending > 0)
+			pthread_cond_wait(&walk->work, &walk->idle_lock);
+		if (walk->queued == 0)
+		{
+			pthread_mutex_unlock(&walk->idle_lock);
+			break;
+		}
+		// Claiming one of the queued directories means the deques hold one for us,
+		// though a scan may race with the workers taking the others.
+		walk->queued--;
+		pthread_mutex_unlock(&walk->idle_lock);
+		struct DirNode *node;
+		while ((node = PopDirectory(walk, worker->id)) == NULL)
+			;
+
+		ReadDirectory(walk, worker->id, node, dents);
+		pthread_mutex_lock(&walk->idle_lock);
+		if (--walk->pending == 0) pthread_cond_broadcast(&walk->work);
+		pthread_mutex_unlock(&walk->idle_lock);
+	}
+	free(dents);
+	return NULL;
+}
 
-				// Make sure within number of pipes given by project specs.
-				pipeSet->num_pipes++;
-				if (pipeSet->num_pipes > PIPED_CMD_MAX - 1)
-				{
-					ParsingError(PIPE_OVERFLOW, 0);
-					return 1;
-				}
+// Lists the total bytes under every directory of the tree rooted at options->dir.
+int WalkTree(struct SlsOptions *options)
+{
+	int num_workers = sls_threads;
+	struct TreeWalk walk = { options->all, num_workers, NULL,
+		PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0,
+		PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0 };
+	walk.queues = calloc(num_workers, sizeof(struct WalkQueue));
+	for (int i = 0; i < num_workers; i++) pthread_mutex_init(&walk.queues[i].lock, NULL);
+	// Trailing slashes would be doubled in every path below the root.
+	char *root = strdup(options->dir);
+	size_t root_len = strlen(root);
+	while (root_len > 1 && root[root_len - 1] == '/') root[--root_len] = '\0';
+	PushDirectory(&walk, 0, NULL, root);
 
-				// If the symbol was actually "|&" indicate that stderr needs to be piped.
-				if (i < (int) strlen(cmd) - 1)
-				{
-					if (cmd[i + 1] == '&')
-					{
-						allCmd->commands[allCmd->num_cmd].err_to_pipe = 1;
-						i++;
-					}
-				} 				
+	// The shell's thread is worker 0. Deques of workers that could not be started
+	// stay empty, so num_workers never changes while the walk runs.
+	struct WalkWorker workers[64];
+	pthread_t threads[64];
+	int num_threads = 0;
+	for (int i = 0; i < num_workers; i++) workers[i] = (struct WalkWorker) { &walk, i };
+	while (num_threads < num_workers - 1
+		&& !pthread_create(&threads[num_threads], NULL, RunWalkWorker, &workers[num_threads + 1]))
+		num_threads++;
+	RunWalkWorker(&workers[0]);
+	for (int i = 0; i < num_threads; i++) pthread_join(threads[i], NULL);
 
-				// Define and set up new target. 
-				// First argument of the next Command object in the CommandSet.
-				allCmd->num_cmd++;
-				InitCommand(&allCmd->commands[allCmd->num_cmd]);
-				target = allCmd->commands[allCmd->num_cmd].arguments[
-					allCmd->commands[allCmd->num_cmd].num_args];
+	// Children come after their parent, so one backwards pass totals every subtree.
+	struct SlsRecord *records = malloc(walk.num_nodes * sizeof(struct SlsRecord));
+	for (size_t i = 0; i < walk.num_nodes; i++) records[i].size = walk.nodes[i]->bytes;
+	for (size_t i = walk.num_nodes - 1; i > 0; i--)
+		records[walk.nodes[i]->parent->seq].size += records[i].size;
 
-				// Start looking for the first argument of a new Command.
-				encounter_whitespace = 0;
-				init_skip = 1;
-				read_mode = SEARCH_COMMAND;
-				break;
-			case '>':
-				// Attempt to copy token to target location.
-				if (!CopyToken(segment, target, &length, read_mode)) return 1;
-				if (read_mode == SEARCH_COMMAND) allCmd->commands[allCmd->num_cmd].num_args++;
+	// Pack the paths of the directories that could be read into one pool.
+	struct OutputBuffer paths = { NULL, 0, 0 };
+	size_t num_records = 0;
+	for (size_t i = 0; i < walk.num_nodes; i++)
+	{
+		if (walk.nodes[i]->failed) continue;
+		size_t path_len = strlen(walk.nodes[i]->path) + 1;
+		ReserveOutput(&paths, path_len);
+		memcpy(paths.data + paths.length, walk.nodes[i]->path, path_len);
+		records[num_records++] = (struct SlsRecord) { paths.length, records[i].size };
+		paths.length += path_len;
+	}
 
-				// Make sure within 16 argument threshold.
-				if (allCmd->commands[allCmd->num_cmd].num_args > ARGS_MAX)
-				{
-					ParsingError(ARG_OVERFLOW, 0);
-					return 1;
-				}
+	int status = PrintRecords(paths.data, records, num_records, options) || walk.errors;
+	free(paths.data);
+	free(records);
+	for (size_t i = 0; i < walk.num_nodes; i++)
+	{
+		free(walk.nodes[i]->path);
+		free(walk.nodes[i]);
+	}
+	free(walk.nodes);
+	for (int i = 0; i < num_workers; i++)
+	{
+		pthread_mutex_destroy(&walk.queues[i].lock);
+		free(walk.queues[i].items);
+	}
+	free(walk.queues);
+	pthread_mutex_destroy(&walk.idle_lock);
+	pthread_cond_destroy(&walk.work);
+	return status;
+}
 
-				// Set new target as the output filename of current Command.
-				target = allCmd->commands[allCmd->num_cmd].output_name;
-				allCmd->commands[allCmd->num_cmd].output_to_file = 1;
+int SlsUsage(void)
+{
+	fprintf(stderr, "Error: usage: sls [-R] [-a] [-N] [-S] [-m SIZE] [-g GLOB] [-n N] [dir]\n");
+	return 1;
+}
 
-				// If the symbol is actually ">&", indicate to output stderr to a file.
-				if (i < (int) strlen(cmd) - 1)
-				{
-					if (cmd[i + 1] == '&')
-					{
-						allCmd->commands[allCmd->num_cmd].err_to_file = 1;
-						i++;
-					}
-				} 
+// sls [-R] [-a] [-N] [-S] [-m SIZE] [-g GLOB] [-n N] [dir]
+int sls(struct Command *cmd)
+{
+	struct SlsOptions options = { 0, 0, 0, 0, 0, NULL, -1, "." };
+	int option;
+	char *end;
 
-				// Start looking for a file name.
-				encounter_whitespace = 0;
-				read_mode = SEARCH_FILENAME;
+	// Reset getopt, which main has already used, and report errors ourselves.
+	optind = 0;
+	opterr = 0;
+	while ((option = getopt(cmd->num_args, cmd->arguments, "+RaNSm:g:n:")) != -1)
+	{
+		switch (option)
+		{
+			case 'R':
+				options.recursive = 1;
 				break;
-			case ' ':
-				if (read_mode == SEARCH_COMMAND) encounter_whitespace = 1; 
-				// Only count whitespace for filename search if build process has started.
-				if (read_mode == SEARCH_FILENAME && length > 0) {
-					encounter_whitespace = 1;
-				}
+			case 'a':
+				options.all = 1;
+				break;
+			case 'N':
+				options.by_name = 1;
+				break;
+			case 'S':
+				options.by_size = 1;
+				break;
+			case 'm':
+				options.min_size = ParseSize(optarg, LLONG_MAX);
+				if (options.min_size < 0) return SlsUsage();
+				break;
+			case 'g':
+				options.glob = optarg;
+				break;
+			case 'n':
+				options.limit = strtol(optarg, &end, 10);
+				if (*end != '\0' || options.limit < 0) return SlsUsage();
 				break;
 			default:
-				// Encountered the first character of a new token (token___token).
-				// init_skip prevents command argument copies for cases like ____(token).
-				if (encounter_whitespace && !init_skip)
-				{
-					// Attempt to copy token to target location.
-					if (!CopyToken(segment, target, &length, read_mode)) return 1;
-					if (read_mode == SEARCH_COMMAND) allCmd->commands[allCmd->num_cmd].num_args++;
+				return SlsUsage();
+		}
+	}
+	if (optind < cmd->num_args) options.dir = cmd->arguments[optind];
+	if (optind + 1 < cmd->num_args) return SlsUsage();
 
-					// Make sure within 16 argument threshold.
-					if (allCmd->commands[allCmd->num_cmd].num_args > ARGS_MAX)
-					{
-						ParsingError(ARG_OVERFLOW, 0);
-						return 1;
-					}
-					// Assign new target to next argument of the Command.
-					target = allCmd->commands[allCmd->num_cmd].arguments[
-						allCmd->commands[allCmd->num_cmd].num_args];
-					read_mode = SEARCH_COMMAND;
-				}
-				init_skip = 0;
-				encounter_whitespace = 0;
-				// Add the character to the token and keep reading.
-				segment[length] = read_char;
-				length++;
-				break;
-		}			
+	if (options.recursive) return WalkTree(&options);
+	return ListDirectory(&options);
+}
+
+// Builtin to inspect and manage the command cache.
+// hash: list entries, hash -r: clear, hash -d name: forget name, hash name...: pre-warm.
+int HashBuiltin(struct Command *cmd)
+{
+	int status = 0;
+	CheckPathChange();
+
+	if (cmd->num_args == 1)
+	{
+		if (cmd_cache.num_entries == 0)
+		{
+			printf("hash: hash table empty\n");
+			return 0;
+		}
+		printf("hits\tcommand\n");
+		for (int i = 0; i < HASH_BUCKETS; i++)
+			for (struct HashEntry *entry = cmd_cache.buckets[i]; entry; entry = entry->next)
+				printf("%4d\t%s\n", entry->hits, entry->path);
+		return 0;
 	}
 
-	// End of parsing, handle any hanging text.
-	// The command has a hanging meta-character, or the user entered nothing.
-	if (length == 0) {
-		if (allCmd->commands[0].num_args > 0) ParsingError(MISSING_TOKEN, read_mode);
+	if (!strcmp(cmd->arguments[1], "-r"))
+	{
+		ClearCache();
+		return 0;
+	}
+
+	if (!strcmp(cmd->arguments[1], "-d"))
+	{
+		for (int i = 2; i < cmd->num_args; i++)
+		{
+			if (!ForgetCommand(cmd->arguments[i]))
+			{
+				fprintf(stderr, "hash: %s: not found\n", cmd->arguments[i]);
+				status = 1;
+			}
+		}
+		return status;
+	}
+
+	// Pre-warm the table without counting a hit.
+	for (int i = 1; i < cmd->num_args; i++)
+	{
+		if (strchr(cmd->arguments[i], '/')) continue;
+		if (FindCommand(cmd->arguments[i])) continue;
+		if (!LookupCommand(cmd->arguments[i]))
+		{
+			fprintf(stderr, "hash: %s: not found\n", cmd->arguments[i]);
+			status = 1;
+			continue;
+		}
+		FindCommand(cmd->arguments[i])->hits = 0;
+	}
+	return status;
+}
+
+// Builtin to change shell settings.
+// set: print settings, set pipesize SIZE: pipe capacity, set launcher spawn|fork,
+// set relay on|off: run cat and tee stages as relay stages,
+// set pipefail on|off: stop upstream stages when one fails.
+int SetBuiltin(struct Command *cmd)
+{
+	if (cmd->num_args == 1)
+	{
+		printf("pipesize %d\n", pipe_size);
+		printf("launcher %s\n", launcher == LAUNCH_FORK ? "fork" : "spawn");
+		printf("relay %s\n", relay_stages ? "on" : "off");
+		printf("pipefail %s\n", pipefail ? "on" : "off");
+		return 0;
+	}
+	if (cmd->num_args != 3)
+	{
+		fprintf(stderr, "Error: usage: set [pipesize SIZE | launcher spawn|fork | relay on|off"
+			" | pipefail on|off]\n");
 		return 1;
 	}
 
-	// Otherwise, copy the hanging text to the target and update final parameters.
-	if (!CopyToken(segment, target, &length, read_mode)) return 1;
-	if (read_mode == SEARCH_COMMAND) allCmd->commands[allCmd->num_cmd].num_args++;
-	// Make sure within 16 argument threshold.
-	if (allCmd->commands[allCmd->num_cmd].num_args > ARGS_MAX)
+	char *name = cmd->arguments[1];
+	char *value = cmd->arguments[2];
+	if (!strcmp(name, "pipesize"))
+	{
+		int size = ParsePipeSize(value);
+		if (size < 0)
+		{
+			fprintf(stderr, "Error: invalid pipe size\n");
+			return 1;
+		}
+		pipe_size = size;
+	}
+	else if (!strcmp(name, "launcher") && (!strcmp(value, "spawn") || !strcmp(value, "fork")))
+	{
+		launcher = strcmp(value, "fork") ? LAUNCH_SPAWN : LAUNCH_FORK;
+	}
+	else if (!strcmp(name, "relay") && (!strcmp(value, "on") || !strcmp(value, "off")))
+	{
+		relay_stages = !strcmp(value, "on");
+	}
+	else if (!strcmp(name, "pipefail") && (!strcmp(value, "on") || !strcmp(value, "off")))
+	{
+		pipefail = !strcmp(value, "on");
+	}
+	else
 	{
-		ParsingError(ARG_OVERFLOW, 0);
+		fprintf(stderr, "Error: unknown setting\n");
 		return 1;
 	}
-	allCmd->num_cmd++;
 	return 0;
 }
 
-// MISC BUILTIN
-// Special ls that prints all filenames and byte size of current directory.
-// REF: dir_scan.c, stat.c, "Syscalls" slides 32-33.
-int sls()
+// Returns how many characters a leading "time" keyword takes up, 0 if there is none.
+// The keyword must be followed by a command.
+int TimeKeyword(const char *cmd, int cmd_len)
 {
-	DIR *current_dir;
-	struct dirent *directory_file;
-	struct stat file_info;
+	int i = 0;
+	while (i < cmd_len && cmd[i] == ' ') i++;
+	if (cmd_len - i <= 5 || strncmp(cmd + i, "time ", 5)) return 0;
+	return i + 5;
+}
 
-	// Open the current directory and get its first file.
-	current_dir = opendir(".");
-	// Account for directories that lack permissions.
-	if (current_dir == NULL)
+// SCRIPT BUILTINS
+// echo, printf, test, [, true and false are run by the shell itself, so a script
+// full of them needs no fork or exec. Their output goes through stdout's buffer,
+// which is enlarged when stdout is not a terminal and is only flushed when a child
+// is launched, a completion message is printed or stdout is redirected, so a run of
+// echo lines costs one write per buffer rather than a process each. When stderr
+// is the same file, the buffer is written a line at a time to keep errors in order.
+
+// true
+int TrueBuiltin(struct Command *cmd)
+{
+	(void) cmd;
+	return 0;
+}
+
+// false
+int FalseBuiltin(struct Command *cmd)
+{
+	(void) cmd;
+	return 1;
+}
+
+// echo [-n] [arg...]
+int EchoBuiltin(struct Command *cmd)
+{
+	int first = 1;
+	int newline = 1;
+	if (cmd->num_args > 1 && !strcmp(cmd->arguments[1], "-n"))
 	{
-		fprintf(stderr, "Error: cannot open directory\n");
+		newline = 0;
+		first = 2;
+	}
+	for (int i = first; i < cmd->num_args; i++)
+	{
+		if (i > first) putchar(' ');
+		fputs(cmd->arguments[i], stdout);
+	}
+	if (newline) putchar('\n');
+	return 0;
+}
+
+// Prints the backslash escape starting at format[0] to out and returns how many
+// characters it takes up.
+int PrintEscape(FILE *out, const char *format)
+{
+	static const char escapes[] = "n\nt\tr\rb\ba\af\fv\v\\\\\"\"";
+	if (format[0] == '\0')
+	{
+		putc('\\', out);
+		return 0;
+	}
+	if (format[0] >= '0' && format[0] <= '7')
+	{
+		// Up to three octal digits.
+		int value = 0;
+		int length = 0;
+		while (length < 3 && format[length] >= '0' && format[length] <= '7')
+			value = value * 8 + format[length++] - '0';
+		putc(value, out);
+		return length;
+	}
+	for (int i = 0; escapes[i]; i += 2)
+	{
+		if (escapes[i] == format[0])
+		{
+			putc(escapes[i + 1], out);
+			return 1;
+		}
+	}
+	putc('\\', out);
+	putc(format[0], out);
+	return 1;
+}
+
+// Reads a printf number argument, which may also be a quoted character.
+// Sets *status to 1 if it is not a number.
+long long PrintfNumber(const char *arg, int *status)
+{
+	char *end;
+	if (arg[0] == '\'' || arg[0] == '"') return (unsigned char) arg[1];
+	errno = 0;
+	long long value = strtoll(arg, &end, 0);
+	if (end == arg || *end != '\0' || errno)
+	{
+		fprintf(stderr, "Error: printf: invalid number '%s'\n", arg);
+		*status = 1;
+	}
+	return value;
+}
+
+// printf FORMAT [arg...]
+// Supports the escapes \n \t \r \b \a \f \v \\ \" \NNN and the conversions
+// %s %b %c %d %i %u %o %x %X %% with flags, width and precision. The format is
+// reused while arguments remain, and missing arguments read as "" or 0.
+int PrintfBuiltin(struct Command *cmd)
+{
+	if (cmd->num_args < 2)
+	{
+		fprintf(stderr, "Error: usage: printf FORMAT [arg...]\n");
 		return 1;
 	}
-	directory_file = readdir(current_dir);
-	while (directory_file != NULL)
+	const char *format = cmd->arguments[1];
+	int next = 2;
+	int status = 0;
+	do
+	{
+		int consumed = 0;
+		for (const char *c = format; *c; c++)
+		{
+			if (*c == '\\')
+			{
+				c += PrintEscape(stdout, c + 1);
+				continue;
+			}
+			if (*c != '%')
+			{
+				putchar(*c);
+				continue;
+			}
+			if (c[1] == '%')
+			{
+				putchar('%');
+				c++;
+				continue;
+			}
+
+			// Copy the flags, width and precision into a conversion for printf.
+			char spec[32] = "%";
+			size_t spec_len = 1;
+			c++;
+			while (*c && strchr("-+ #0123456789.", *c) && spec_len < sizeof(spec) - 4)
+				spec[spec_len++] = *c++;
+			const char *arg = next < cmd->num_args ? cmd->arguments[next++] : NULL;
+			consumed = 1;
+			switch (*c)
+			{
+				case 's':
+					spec[spec_len++] = 's';
+					printf(spec, arg ? arg : "");
+					break;
+				case 'b':
+				{
+					// Like %s once the argument's own escapes are expanded.
+					char *expanded = NULL;
+					size_t expanded_len = 0;
+					FILE *out = open_memstream(&expanded, &expanded_len);
+					for (const char *a = arg ? arg : ""; *a; a++)
+					{
+						if (*a == '\\') a += PrintEscape(out, a + 1);
+						else putc(*a, out);
+					}
+					fclose(out);
+					spec[spec_len++] = 's';
+					printf(spec, expanded);
+					free(expanded);
+					break;
+				}
+				case 'c':
+					// A missing argument prints nothing, apart from any padding.
+					spec[spec_len++] = arg ? 'c' : 's';
+					if (arg) printf(spec, arg[0]);
+					else printf(spec, "");
+					break;
+				case 'd':
+				case 'i':
+				case 'u':
+				case 'o':
+				case 'x':
+				case 'X':
+					spec[spec_len++] = 'l';
+					spec[spec_len++] = 'l';
+					spec[spec_len++] = *c;
+					printf(spec, arg ? PrintfNumber(arg, &status) : 0LL);
+					break;
+				default:
+					fprintf(stderr, "Error: printf: invalid conversion\n");
+					return 1;
+			}
+		}
+		if (!consumed) break;
+	} while (next < cmd->num_args);
+	return status;
+}
+
+// Evaluates a test expression of one argument: true if it is not empty.
+// Two and three argument forms are unary and binary operators, each optionally
+// negated by a leading "!". Returns 0 for true, 1 for false and 2 for an error.
+int TestExpression(char **args, int num_args)
+{
+	if (num_args == 0) return 1;
+	if (!strcmp(args[0], "!") && num_args > 1)
+	{
+		int result = TestExpression(args + 1, num_args - 1);
+		return result == 2 ? 2 : !result;
+	}
+	if (num_args == 1) return args[0][0] == '\0';
+
+	if (num_args == 2)
+	{
+		const char *op = args[0];
+		const char *operand = args[1];
+		struct stat file_info;
+		if (!strcmp(op, "-n")) return operand[0] == '\0';
+		if (!strcmp(op, "-z")) return operand[0] != '\0';
+		if (!strcmp(op, "-L") || !strcmp(op, "-h"))
+			return lstat(operand, &file_info) || !S_ISLNK(file_info.st_mode);
+		if (!strcmp(op, "-r")) return access(operand, R_OK) != 0;
+		if (!strcmp(op, "-w")) return access(operand, W_OK) != 0;
+		if (!strcmp(op, "-x")) return access(operand, X_OK) != 0;
+		if (op[0] == '-' && op[1] && !op[2] && strchr("edfs", op[1]))
+		{
+			if (stat(operand, &file_info)) return 1;
+			if (op[1] == 'd') return !S_ISDIR(file_info.st_mode);
+			if (op[1] == 'f') return !S_ISREG(file_info.st_mode);
+			if (op[1] == 's') return file_info.st_size == 0;
+			return 0;
+		}
+	}
+	else if (num_args == 3)
+	{
+		static const char *comparisons[] = { "-eq", "-ne", "-lt", "-le", "-gt", "-ge" };
+		const char *op = args[1];
+		if (!strcmp(op, "=")) return strcmp(args[0], args[2]) != 0;
+		if (!strcmp(op, "!=")) return strcmp(args[0], args[2]) == 0;
+		for (int i = 0; i < 6; i++)
+		{
+			if (strcmp(op, comparisons[i])) continue;
+			char *end_left, *end_right;
+			long long left = strtoll(args[0], &end_left, 10);
+			long long right = strtoll(args[2], &end_right, 10);
+			if (end_left == args[0] || *end_left || end_right == args[2] || *end_right)
+			{
+				fprintf(stderr, "Error: test: integer expected\n");
+				return 2;
+			}
+			int result[] = { left == right, left != right, left < right,
+				left <= right, left > right, left >= right };
+			return !result[i];
+		}
+	}
+	fprintf(stderr, "Error: test: unknown expression\n");
+	return 2;
+}
+
+// test EXPRESSION, [ EXPRESSION ]
+int TestBuiltin(struct Command *cmd)
+{
+	int num_args = cmd->num_args - 1;
+	if (!strcmp(cmd->arguments[0], "["))
 	{
-		// Skip ".", "..", and all hidden files and folders.
-		if (directory_file->d_name[0] != '.')
+		if (num_args == 0 || strcmp(cmd->arguments[num_args], "]"))
 		{
-			// Get the file's information in a readable form.
-			stat(directory_file->d_name, &file_info);
-			// Print filename then size in bytes.
-			printf("%s (%d bytes)\n", directory_file->d_name, (int) file_info.st_size);
+			fprintf(stderr, "Error: [: missing ]\n");
+			return 2;
 		}
-		// Get the next file until all files have been read.
-		directory_file = readdir(current_dir);
+		num_args--;
+	}
+	return TestExpression(cmd->arguments + 1, num_args);
+}
+
+// cd DIR
+int CdBuiltin(struct Command *cmd)
+{
+	if (chdir(cmd->arguments[1]))
+	{
+		fprintf(stderr, "Error: cannot cd into directory\n");
+		return 1;
 	}
 	return 0;
 }
 
-int main(void)
+// pwd
+int PwdBuiltin(struct Command *cmd)
+{
+	char current_dir[PATH_MAX];
+	(void) cmd;
+	getcwd(current_dir, sizeof(current_dir));
+	printf("%s\n", current_dir);
+	return 0;
+}
+
+// exit is carried out by main when it is a command line of its own, and does
+// nothing anywhere else.
+int ExitBuiltin(struct Command *cmd)
+{
+	(void) cmd;
+	return 0;
+}
+
+// BUILTIN REGISTRY
+// Builtins live in a table indexed by a perfect hash of their first character, last
+// character and length, so finding one costs a hash and a single strcmp instead of a
+// strcmp per builtin. Entries are placed with designated initializers computed at
+// compile time; two builtins that hash to the same slot initialize it twice, which
+// -Woverride-init (part of -Wextra) turns into a build error. When adding a builtin,
+// pick another multiplier or a bigger table if that happens.
+#define BUILTIN_SLOTS 32
+#define BUILTIN_HASH(first, last, length) \
+	(((unsigned char) (first) + 6 * (unsigned char) (last) + 3 * (length)) & (BUILTIN_SLOTS - 1))
+#define BUILTIN_OUTPUT BUILTIN_FORKLESS
+#define BUILTIN_SHELL (BUILTIN_FORKLESS | BUILTIN_STATE)
+
+const struct Builtin builtins[BUILTIN_SLOTS] = {
+	[BUILTIN_HASH('e', 't', 4)] = { "exit", ExitBuiltin, BUILTIN_STATE },
+	[BUILTIN_HASH('c', 'd', 2)] = { "cd", CdBuiltin, BUILTIN_SHELL },
+	[BUILTIN_HASH('p', 'd', 3)] = { "pwd", PwdBuiltin, BUILTIN_OUTPUT },
+	[BUILTIN_HASH('s', 's', 3)] = { "sls", sls, BUILTIN_OUTPUT },
+	[BUILTIN_HASH('h', 'h', 4)] = { "hash", HashBuiltin, BUILTIN_SHELL },
+	[BUILTIN_HASH('s', 't', 3)] = { "set", SetBuiltin, BUILTIN_SHELL },
+	[BUILTIN_HASH('j', 's', 4)] = { "jobs", JobsBuiltin, BUILTIN_SHELL },
+	[BUILTIN_HASH('f', 'g', 2)] = { "fg", FgBuiltin, BUILTIN_SHELL },
+	[BUILTIN_HASH('b', 'g', 2)] = { "bg", BgBuiltin, BUILTIN_SHELL },
+	[BUILTIN_HASH('w', 't', 4)] = { "wait", WaitBuiltin, BUILTIN_SHELL },
+	[BUILTIN_HASH('e', 'o', 4)] = { "echo", EchoBuiltin, BUILTIN_OUTPUT },
+	[BUILTIN_HASH('p', 'f', 6)] = { "printf", PrintfBuiltin, BUILTIN_OUTPUT },
+	[BUILTIN_HASH('t', 't', 4)] = { "test", TestBuiltin, BUILTIN_OUTPUT },
+	[BUILTIN_HASH('[', '[', 1)] = { "[", TestBuiltin, BUILTIN_OUTPUT },
+	[BUILTIN_HASH('t', 'e', 4)] = { "true", TrueBuiltin, BUILTIN_OUTPUT },
+	[BUILTIN_HASH('f', 'e', 5)] = { "false", FalseBuiltin, BUILTIN_OUTPUT },
+};
+
+const struct Builtin *FindBuiltin(const char *name)
+{
+	size_t length = strlen(name);
+	if (length == 0) return NULL;
+	const struct Builtin *builtin = &builtins[BUILTIN_HASH(name[0], name[length - 1], length)];
+	if (builtin->name == NULL || strcmp(builtin->name, name)) return NULL;
+	return builtin;
+}
+
+// Makes sure every entry sits in the slot its name hashes to, so a typo in the
+// table cannot hide a builtin.
+void CheckBuiltins(void)
+{
+	for (int i = 0; i < BUILTIN_SLOTS; i++)
+	{
+		if (builtins[i].name && FindBuiltin(builtins[i].name) != &builtins[i])
+		{
+			fprintf(stderr, "Error: builtin %s is in the wrong slot\n", builtins[i].name);
+			abort();
+		}
+	}
+}
+
+// Usage: sshell [-q] [-c command | script]
+// -c runs the given command lines and script runs a file ("-" for stdin). Both are
+// batch modes that skip the prompt and the echo. -q drops the "+ completed" trailer.
+int main(int argc, char **argv)
 {
-	char cmd[CMDLINE_MAX];
-	char current_dir[CMDLINE_MAX];
+	char *cmd = "";
+	int cmd_len = 0;
 	struct CommandSet CommandCenter;
 	struct PipeEnv PipeManager;
+	struct LineReader input;
+	int batch_mode = 0;
+	int exit_requested = 0;
+	int last_status = 0;
+	char *command_string = NULL;
+	int option;
+
+	while ((option = getopt(argc, argv, "+qc:")) != -1)
+	{
+		switch (option)
+		{
+			case 'q':
+				print_trailer = 0;
+				break;
+			case 'c':
+				command_string = optarg;
+				break;
+			default:
+				fprintf(stderr, "Usage: sshell [-q] [-c command | script]\n");
+				return 2;
+		}
+	}
+
+	// Pick the input source.
+	if (command_string)
+	{
+		batch_mode = 1;
+		InitStringReader(&input, command_string, strlen(command_string));
+	}
+	else if (optind < argc && strcmp(argv[optind], "-"))
+	{
+		batch_mode = 1;
+		if (!InitFileReader(&input, argv[optind]))
+		{
+			fprintf(stderr, "Error: cannot open script\n");
+			return 1;
+		}
+	}
+	else
+	{
+		batch_mode = optind < argc;
+		InitFdReader(&input, STDIN_FILENO);
+	}
+
+	InitLauncher();
+	InitPipeSize();
+	InitRelay();
+	InitScanner();
+	InitStats();
+	InitTrace();
+	InitSlsThreads();
+	CheckBuiltins();
+	// Builtin output shares one large buffer unless a person is watching it. When
+	// errors go to the same file, whole lines are written so the two stay in order.
+	struct stat out_info, err_info;
+	shared_stderr = !fstat(STDOUT_FILENO, &out_info) && !fstat(STDERR_FILENO, &err_info)
+		&& out_info.st_dev == err_info.st_dev && out_info.st_ino == err_info.st_ino;
+	if (!isatty(STDOUT_FILENO))
+		setvbuf(stdout, NULL, shared_stderr ? _IOLBF : _IOFBF, READER_BLOCK_SIZE);
+	InitJobControl(!batch_mode);
+
+	CommandCenter.arena = (struct Arena) { NULL, NULL, NULL };
 
 	while (1) {
-		char *nl;
+		// Release everything the previous command line allocated.
+		ArenaReset(&CommandCenter.arena);
 
-		// Print prompt
-		printf("sshell@ucd$ ");
-		fflush(stdout);
+		// Report background jobs that completed since the last command line.
+		ReapJobs();
+		FinishJobs();
 
-		// Get command line
-		fgets(cmd, CMDLINE_MAX, stdin);
+		if (!batch_mode)
+		{
+			// Print prompt
+			printf("sshell@ucd$ ");
+			fflush(stdout);
+		}
+
+		// Get command line without its newline, stopping at the end of input.
+		cmd = ReadLine(&input, &cmd_len);
+		if (cmd == NULL) break;
 
 		// Print command line if stdin is not provided by terminal.
-		if (!isatty(STDIN_FILENO)) {
-			printf("%s", cmd);
+		if (!batch_mode && !isatty(STDIN_FILENO)) {
+			printf("%.*s\n", cmd_len, cmd);
 			fflush(stdout);
 		}
 
-		// Remove trailing newline from command line.
-		nl = strchr(cmd, '\n');
-		if (nl)
-			*nl = '\0';
-	
-		// Begin parsing of the command line.
-		int parse_failure = ParseCmd(&CommandCenter, &PipeManager, cmd);
+		// Begin parsing of the command line, after any "time" keyword.
+		int skip = TimeKeyword(cmd, cmd_len);
+		struct timespec parse_start = Now();
+		int parse_failure = ParseCmd(&CommandCenter, cmd + skip, cmd_len - skip);
+		TraceSpan("parse", parse_start, -1);
+		CommandCenter.timed = stats_mode || skip > 0;
 		// If no parsing errors, result is a set of Commands to execute.
 		if (!parse_failure)
 		{
-			// Check the first command to detect builtin commands.
+			// Exit is only honoured as a command line of its own.
 			struct Command *FirstCommand = &CommandCenter.commands[0];
-			char *first_command_name = FirstCommand->arguments[0];
-			// Builtin commands
-			if (!strcmp(first_command_name, "exit")) {
+			int exit_line = CommandCenter.num_cmd == 1 && !CommandCenter.background
+				&& !strcmp(FirstCommand->arguments[0], "exit");
+			// Interactively, exit is refused while jobs run. A script that exits
+			// waits for its jobs, like a script that reaches its end.
+			if (exit_line && jobs && !batch_mode) {
+				fflush(stdout);
+				fprintf(stderr, "Error: active job still running\n");
+				FirstCommand->exit_status = 1;
+			} else if (exit_line) {
+				WaitAllJobs();
+				fflush(stdout);
 				fprintf(stderr, "Bye...\n");
+				exit_requested = 1;
 				break;
-			} else if (!strcmp(first_command_name, "cd")) {
-				FirstCommand->exit_status = chdir(FirstCommand->arguments[1]);
-				if (FirstCommand->exit_status) 
-				{
-					fprintf(stderr, "Error: cannot cd into directory\n");
-					FirstCommand->exit_status = 1;
-				}
-			} else if (!strcmp(first_command_name, "pwd")) {
-				getcwd(current_dir, sizeof(current_dir));
-				printf("%s\n", current_dir);
-				FirstCommand->exit_status = 0;
-			} else if (!strcmp(first_command_name, "sls")) {
-				FirstCommand->exit_status = sls();
 			} else {
-				// Execute regular commands.
+				// Execute commands and builtins.
 				RunAllCmd(&CommandCenter, &PipeManager);
+				// Background jobs report their completion message when they are reaped.
+				if (CommandCenter.background)
+				{
+					AddJob(&CommandCenter, cmd, cmd_len);
+					last_status = 0;
+					continue;
+				}
 			}
+			last_status = PipelineStatus(&CommandCenter);
 			// Completed message.
-			fprintf(stderr, "+ completed '%s' ", cmd);
-			for (int i = 0; i < CommandCenter.num_cmd; i++) fprintf(stderr, "[%d]", 
-				CommandCenter.commands[i].exit_status);
-			fprintf(stderr, "\n");
+			if (print_trailer) PrintCompleted(cmd, cmd_len, &CommandCenter);
 		}	
 	}
-	fprintf(stderr, "+ completed '%s' [%d]\n", cmd, 0);
+	// At the end of input, let the remaining jobs run to completion.
+	WaitAllJobs();
+	if (!exit_requested) return last_status;
+	if (print_trailer) fprintf(stderr, "+ completed '%.*s' [%d]\n", cmd_len, cmd, 0);
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,35 @@
+#!/bin/bash
+# FD leak check.
+# Lists /proc/self/fd from the first stage of a pipeline, with an extra FD
+# inherited from the caller, under both launchers and with tracing on. Only
+# stdin, stdout, stderr and the directory ls reads /proc/self/fd through (0-3)
+# may be open: pipes, the inherited FD and the trace file must all be swept.
+# Usage: tests/fd_leak.sh [sshell binary]
+set -e
+SSHELL=${1:-./sshell}
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+unset SSHELL_TRACE
+expected=$(printf '0\n1\n2\n3')
+failed=0
+
+check()
+{
+	local name=$1
+	shift
+	local listed
+	listed=$("$@" "$SSHELL" -q -c 'ls /proc/self/fd | cat' 7< /dev/null 2>&1)
+	if [ "$listed" = "$expected" ]; then
+		echo "ok $name"
+	else
+		echo "FAIL $name:" $listed
+		failed=1
+	fi
+}
+
+for mode in spawn fork; do
+	check "$mode" env SSHELL_LAUNCHER=$mode
+	check "$mode traced" env SSHELL_LAUNCHER=$mode SSHELL_TRACE="$WORK/trace.json"
+done
+exit $failed